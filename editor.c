@@ -3,23 +3,46 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define KILO_SIMD
+#endif
+
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_HL_BATCH_ROWS 2048      // rows lexed per background batch
+#define KILO_HL_BATCH_BYTES (1 << 20)
+#define KILO_ESC_TIMEOUT 50          // ms to wait for the rest of an escape sequence
+#define KILO_FRAME_STALL 100         // ms of input after which a frame is drawn anyway
+#define KILO_RESIZE_SETTLE 30        // ms without SIGWINCH before a resize is handled
+#define KILO_PASTE_TIMEOUT 3000      // ms of silence that ends a paste missing its ESC[201~
+#define KILO_UNDO_LIMIT (64 << 20)   // bytes of undo log; $KILO_UNDO_MB overrides
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -39,7 +62,9 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE, // bracketed paste; the text is in input.paste
+	WINDOW_RESIZE // handled inside editorReadKey()
 };
 
 enum editorHightlight {
@@ -53,10 +78,23 @@ enum editorHightlight {
 	HL_MATCH
 };
 
+enum undoType {
+	UNDO_INSERT, // text put into a row
+	UNDO_DELETE, // text taken out of a row
+	UNDO_INSERT_ROW,
+	UNDO_DELETE_ROW
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
 /* data */
+struct syntaxKeyword {
+	const char *word;
+	int len;
+	unsigned char hl;
+};
+
 struct editorSyntax {
 	char *filetype;
 	char **filematch;
@@ -65,32 +103,87 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	char *separators; // NULL for the default set
+	/* compiled by editorSyntaxCompile() */
+	unsigned char cclass[256];
+	struct syntaxKeyword *kwtable;
+	unsigned int kwmask;
+	int kw_maxlen;
+	int scs_len, mcs_len, mce_len;
 };
 
+/* Highlighting is kept as runs: the run length in the upper 24 bits and
+ * the HL_* value in the low byte. The runs of a row add up to rsize; up
+ * to two of them are stored in the row itself, see editorRowSpans(). */
+typedef unsigned int hlSpan;
+#define HL_SPAN_MAX ((1 << 24) - 1)
+
 typedef struct erow {
-	int idx;
+	char *chars;
+	char *render; // chars itself unless the row has tabs
+	union {
+		hlSpan *hl;           // if hlcap != 0
+		hlSpan hl_inline[2];  // otherwise
+	};
 	int size;
 	int rsize;
-	char *chars;
-	char *render;
-	unsigned char *hl;
-	int hl_open_comment;
-	bool damaged; // redraw line
+	unsigned int version; // bumped on every change to chars
+	unsigned char ccap, rcap, hlcap; // log2 of the capacities from storeAlloc(), 0 if not owned
+	unsigned char hl_open_comment; // comment state at the end of the line
+	unsigned char hl_in; // comment state the line was lexed with
+	bool hl_valid;       // hl_open_comment matches chars
+	bool mapped;  // chars point into E.map until the row is edited
 } erow;
 
+/* Rows are stored in a counted B-tree of fixed-size chunks (a rope of
+ * lines): every node knows how many rows live below it, so finding,
+ * inserting and deleting a line costs O(log n) instead of shifting the
+ * whole array. Leaves are aligned to their size, so the leaf holding a
+ * row is found from the row's address, see ropeLeafOf(). */
+#define ROPE_LEAF_SIZE 4096
+#define ROPE_LEAF_ROWS ((ROPE_LEAF_SIZE - 3 * sizeof(void *)) / sizeof(erow))
+#define ROPE_FANOUT 32
+
+typedef struct ropeNode {
+	struct ropeNode *parent;
+	int count; // rows in this subtree
+	int n;     // used entries in child[] or row[]
+	bool leaf;
+	union {
+		struct ropeNode *child[ROPE_FANOUT];
+		erow row[ROPE_LEAF_ROWS];
+	} u;
+} ropeNode;
+
+_Static_assert(sizeof(ropeNode) <= ROPE_LEAF_SIZE, "rope leaf too large");
+
 struct editorConfig {
 	int cx, cy;
 	int rx;
 	int rowoff, coloff;
+	int drawn_rowoff; // rowoff of the frame on screen
 	int screenrows;
 	int screencols;
 	int numrows;
-	erow *row;
+	struct ropeNode *rope;
+	char *map;
+	size_t mapsize;
 	int dirty;
 	char *filename;
 	char statusmsg[80];
 	time_t statusmsg_time;
 	struct editorSyntax *syntax;
+	int hl_checked; // rows above this start in a verified comment state
+	unsigned int version;
+	pthread_mutex_t lock; // held by the main thread except while reading keys
+	atomic_bool lock_wanted; // main thread is waiting for the lock
+	pthread_cond_t hl_cond;
+	struct saveJob *save; // save running in the background, if any
+	pthread_cond_t save_done;
+	bool prompting; // the status bar belongs to editorPrompt()
+	int esc_timeout; // ms, from $KILO_ESC_TIMEOUT or KILO_ESC_TIMEOUT
+	int frame_interval; // ms between frames, from $KILO_MAX_FPS; 0 for no cap
+	struct timespec frame_time; // when editorFrame() last drew
 	struct termios orig_termios;
 };
 
@@ -107,22 +200,38 @@ char *C_HL_keywords[] = {
 
 struct editorSyntax HLDB[] = {
 	{
-		"c",
-		C_HL_extensions,
-		C_HL_keywords,
-		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		.filetype = "c",
+		.filematch = C_HL_extensions,
+		.keywords = C_HL_keywords,
+		.singleline_comment_start = "//",
+		.multiline_comment_start = "/*",
+		.multiline_comment_end = "*/",
+		.flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		.separators = NULL
 	},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/* definitions loaded from syntax files, followed by HLDB */
+struct editorSyntax *syntaxdb = NULL;
+unsigned int syntaxdb_entries = 0;
+
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), bool allow_empty);
 void editorMoveCursor(int key);
 void editorProcessKeypress(int key);
 int getWindowSize(int *rows, int *cols);
+bool editorSyntaxPending();
+int editorHlRun(const unsigned char *hl, int len);
+bool editorSaveHolds(erow *row);
+void editorSearchReset();
+void editorSaveDefer(char *chars, unsigned char cap);
+void editorLock();
+void editorUnlock();
+void screenInvalidate();
+void editorUndoRecord(int type, int row, int col, const char *text, int len);
 
 /* terminal */
 void die(const char *s) {
@@ -140,119 +249,312 @@ void enableRawMode() {
 	raw.c_iflag &= ~(ICRNL | IXON);
 	raw.c_oflag &= ~(OPOST);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	/* reads never block: editorFillInput() polls first */
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 		die("tsetattr");
+	/* pasted text arrives between ESC[200~ and ESC[201~ */
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 void disableRawMode() {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("tcsetattr");
 }
 
-int editorReadKey() {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN)
-			die("read");
-	}
-
-	if (c == '\x1b') {
-		char seq[5];
-
-		if (read(STDIN_FILENO, &seq[0], 1) != 1)
-			return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1)
-			return '\x1b';
-
-		if (seq[0] == '[') {
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1)
-					return '\x1b';
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-						case '1':
-							return HOME_KEY;
-						case '3':
-							return DEL_KEY;
-						case '4':
-							return END_KEY;
-						case '5':
-							return PAGE_UP;
-						case '6':
-							return PAGE_DOWN;
-						case '7':
-							return HOME_KEY;
-						case '8':
-							return END_KEY;
-					}
-				} else if (seq[2] == ';') {
-					if (read(STDIN_FILENO, &seq[3], 1) == -1)
-						return '\x1b';
-					if (read(STDIN_FILENO, &seq[4], 1) == -1)
-						return '\x1b';
-					if (seq[3] == '5')
-						switch (seq[4]) {
-							case 'C':
-								return CTRL_ARROW_RIGHT;
-							case 'D':
-								return CTRL_ARROW_LEFT;
-						}
-					else if (seq[3] == '2')
-						switch (seq[4]) {
-							case 'A':
-								return SHIFT_ARROW_UP;
-							case 'B':
-								return SHIFT_ARROW_DOWN;
-							case 'C':
-								return SHIFT_ARROW_RIGHT;
-							case 'D':
-								return SHIFT_ARROW_LEFT;
-						}
-				}
-			} else {
-				switch (seq[1]) {
-					case 'A':
-						return ARROW_UP;
-					case 'B':
-						return ARROW_DOWN;
-					case 'C':
-						return ARROW_RIGHT;
-					case 'D':
-						return ARROW_LEFT;
-					case 'H':
-						return HOME_KEY;
-					case 'F':
-						return END_KEY;
-				}
-			}
-		} else if (seq[0] == 'O') {
-			switch (seq[1]) {
-				case 'H':
-					return HOME_KEY;
-				case 'F':
-					return END_KEY;
-			}
+/* Input is read in chunks into a buffer and parsed into keys from there.
+ * A sequence that stops part way is completed by later reads, or taken as
+ * it is once no byte has come for the ESC timeout. */
+struct inputBuffer {
+	char buf[4096];
+	int start, end;
+	char *paste; // text of the last bracketed paste
+	size_t paste_len, paste_cap;
+	int resize_pipe[2]; // written by the SIGWINCH handler
+	bool resized; // a resize is waiting to be handled
+};
+
+struct inputBuffer input;
+
+/* Decodes the key at s[0..n). Returns the bytes it takes, or 0 when s may
+ * be the start of a longer sequence and more input could still come. */
+int editorParseKey(const char *s, int n, bool timed_out, int *key) {
+	*key = (unsigned char)s[0];
+	if (s[0] != '\x1b')
+		return 1;
+	if (n < 2)
+		return timed_out;
+	*key = '\x1b';
+
+	if (s[1] == 'O') {
+		if (n < 3)
+			return timed_out ? n : 0;
+		switch (s[2]) {
+			case 'H':
+				*key = HOME_KEY;
+				break;
+			case 'F':
+				*key = END_KEY;
+				break;
 		}
+		return 3;
+	}
+	if (s[1] != '[')
+		return 2;
 
-		return '\x1b';
+	/* CSI: parameters and intermediates, then a final byte */
+	int i = 2;
+	while (i < n && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] <= 0x3f)
+		i++;
+	if (i == n)
+		return timed_out || n > 32 ? n : 0;
+	if ((unsigned char)s[i] < 0x40 || (unsigned char)s[i] > 0x7e)
+		return i;
+	char final = s[i];
+	int p1 = 0, p2 = 0;
+	const char *p = &s[2];
+	while (isdigit((unsigned char)*p))
+		p1 = p1 * 10 + *p++ - '0';
+	if (*p == ';') {
+		p++;
+		while (isdigit((unsigned char)*p))
+			p2 = p2 * 10 + *p++ - '0';
 	}
-	return c;
+
+	if (final == '~') {
+		switch (p1) {
+			case 200:
+				*key = PASTE;
+				break;
+			case 1:
+			case 7:
+				*key = HOME_KEY;
+				break;
+			case 3:
+				*key = DEL_KEY;
+				break;
+			case 4:
+			case 8:
+				*key = END_KEY;
+				break;
+			case 5:
+				*key = PAGE_UP;
+				break;
+			case 6:
+				*key = PAGE_DOWN;
+				break;
+		}
+	} else if (p2 == 5) {
+		switch (final) {
+			case 'C':
+				*key = CTRL_ARROW_RIGHT;
+				break;
+			case 'D':
+				*key = CTRL_ARROW_LEFT;
+				break;
+		}
+	} else if (p2 == 2) {
+		switch (final) {
+			case 'A':
+				*key = SHIFT_ARROW_UP;
+				break;
+			case 'B':
+				*key = SHIFT_ARROW_DOWN;
+				break;
+			case 'C':
+				*key = SHIFT_ARROW_RIGHT;
+				break;
+			case 'D':
+				*key = SHIFT_ARROW_LEFT;
+				break;
+		}
+	} else if (p2 == 0) {
+		switch (final) {
+			case 'A':
+				*key = ARROW_UP;
+				break;
+			case 'B':
+				*key = ARROW_DOWN;
+				break;
+			case 'C':
+				*key = ARROW_RIGHT;
+				break;
+			case 'D':
+				*key = ARROW_LEFT;
+				break;
+			case 'H':
+				*key = HOME_KEY;
+				break;
+			case 'F':
+				*key = END_KEY;
+				break;
+		}
+	}
+	return i + 1;
+}
+
+/* Reads what the terminal has into the input buffer, waiting up to
+ * timeout milliseconds (forever when negative); false if nothing came.
+ * A pending resize counts as input. With settle, its burst is also
+ * waited out and taken; without, it is left in the pipe, since waiting
+ * for it to settle must not happen with the editor lock held. */
+bool editorFillInput(int timeout, bool settle) {
+	if (input.start == input.end)
+		input.start = input.end = 0;
+	if (input.end == sizeof(input.buf)) {
+		memmove(input.buf, &input.buf[input.start], input.end - input.start);
+		input.end -= input.start;
+		input.start = 0;
+	}
+
+	struct pollfd fds[2] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = input.resize_pipe[0], .events = POLLIN},
+	};
+	int ready = poll(fds, 2, timeout);
+	if (ready == -1 && errno != EINTR)
+		die("poll");
+	if (ready <= 0)
+		return false;
+
+	bool resizing = fds[1].revents & POLLIN;
+	if (resizing && settle) {
+		/* a burst of resizes is taken as one, once the size settles */
+		char drain[64];
+		int more;
+		do {
+			while (read(input.resize_pipe[0], drain, sizeof(drain)) > 0)
+				;
+			more = poll(&fds[1], 1, KILO_RESIZE_SETTLE);
+		} while (more == 1 || (more == -1 && errno == EINTR));
+		input.resized = true;
+	}
+	if (!(fds[0].revents & POLLIN))
+		return resizing;
+	ssize_t n = read(STDIN_FILENO, &input.buf[input.end], sizeof(input.buf) - input.end);
+	if (n == -1 && errno != EAGAIN && errno != EINTR)
+		die("read");
+	if (n > 0)
+		input.end += n;
+	return n > 0 || resizing;
+}
+
+void editorPasteAppend(const char *s, size_t len) {
+	if (input.paste_len + len > input.paste_cap) {
+		input.paste_cap = input.paste_cap ? input.paste_cap : 4096;
+		while (input.paste_cap < input.paste_len + len)
+			input.paste_cap *= 2;
+		input.paste = realloc(input.paste, input.paste_cap);
+		if (input.paste == NULL)
+			die("realloc");
+	}
+	memcpy(&input.paste[input.paste_len], s, len);
+	input.paste_len += len;
+}
+
+/* Collects the text of a bracketed paste into input.paste, up to the
+ * closing ESC[201~, or up to a pause of KILO_PASTE_TIMEOUT ms should the
+ * terminal never send it. */
+void editorReadPaste() {
+	static const char end[] = "\x1b[201~";
+	const int endlen = sizeof(end) - 1;
+	struct timespec last, now;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	input.paste_len = 0;
+	while (1) {
+		char *s = &input.buf[input.start];
+		int n = input.end - input.start;
+		char *found = memmem(s, n, end, endlen);
+		if (found) {
+			editorPasteAppend(s, found - s);
+			input.start += found - s + endlen;
+			return;
+		}
+		/* keep what may be the start of the closing sequence */
+		int take = n > endlen - 1 ? n - (endlen - 1) : 0;
+		editorPasteAppend(s, take);
+		input.start += take;
+		n -= take;
+		editorFillInput(KILO_PASTE_TIMEOUT, true);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (input.end - input.start > n) {
+			last = now;
+		} else if ((now.tv_sec - last.tv_sec) * 1000 +
+				(now.tv_nsec - last.tv_nsec) / 1000000 >= KILO_PASTE_TIMEOUT) {
+			editorPasteAppend(&input.buf[input.start], n);
+			input.start = input.end;
+			return;
+		}
+	}
+}
+
+int editorReadTerminalKey() {
+	bool timed_out = false;
+	while (1) {
+		int key;
+		if (input.resized) {
+			input.resized = false;
+			return WINDOW_RESIZE;
+		}
+		if (input.start < input.end) {
+			int used = editorParseKey(&input.buf[input.start], input.end - input.start,
+					timed_out, &key);
+			if (used) {
+				input.start += used;
+				if (key == PASTE)
+					editorReadPaste();
+				return key;
+			}
+		}
+		/* wait forever for a key, or the ESC timeout for the rest of one */
+		bool partial = input.start < input.end;
+		timed_out = !editorFillInput(partial ? E.esc_timeout : -1, true) && partial;
+	}
+}
+
+/* Whether more input (or a resize) is waiting, or arrives within timeout
+ * milliseconds. */
+bool editorInputPending(int timeout) {
+	return input.start < input.end || input.resized || editorFillInput(timeout, false);
 }
 
+/* Only wakes the main loop, which handles the resize in editorResize(). */
 void handleWindowResize(int sig) {
-	signal(SIGWINCH, SIG_IGN);
+	(void)sig;
+	int saved_errno = errno;
+	write(input.resize_pipe[1], "", 1);
+	errno = saved_errno;
+}
 
-	E.rowoff = 0;
-	E.coloff = 0;
+/* Takes the new window size and repaints. The scroll position is kept;
+ * editorScroll() only moves it as far as needed to keep the cursor on
+ * screen. */
+void editorResize() {
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
 		die("getWindowSize");
 	E.screenrows -= 2;
+	screenInvalidate();
 	editorRefreshScreen();
+}
 
-	signal(SIGWINCH, handleWindowResize);
+/* Waits for a key with the editor unlocked, so the background highlighter
+ * can publish rows in the meantime. */
+int editorReadKey() {
+	int c;
+	do {
+		if (editorSyntaxPending())
+			pthread_cond_signal(&E.hl_cond);
+		editorUnlock();
+		c = editorReadTerminalKey();
+		atomic_store(&E.lock_wanted, true);
+		editorLock();
+		atomic_store(&E.lock_wanted, false);
+		if (c == WINDOW_RESIZE)
+			editorResize();
+	} while (c == WINDOW_RESIZE);
+	return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -263,7 +565,8 @@ int getCursorPosition(int *rows, int *cols) {
 		return -1;
 
 	while (i < sizeof(buf) - 1) {
-		if (read(STDIN_FILENO, &buf[i], 1) == -1)
+		struct pollfd fds = {.fd = STDIN_FILENO, .events = POLLIN};
+		if (poll(&fds, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1)
 			break;
 		if (buf[i] == 'R') break;
 		i++;
@@ -292,471 +595,3420 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }	
 
-/* syntax hightlighting */
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if (E.syntax == NULL)
-		return;
-
-	char **keywords = E.syntax->keywords;
-
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+/* row storage */
+/* Row buffers are carved from 64K slabs in power-of-two size classes, 16
+ * bytes to 4K, each with its own free list; longer lines get a
+ * power-of-two block of their own. Rows remember the capacity they were
+ * given as its log2 in one byte, so blocks carry no header, and closing a
+ * file drops every slab at once. */
+#define STORE_SLAB_SIZE (64 << 10)
+#define STORE_MIN_SHIFT 4
+#define STORE_CLASSES 9
+#define STORE_MAX_SHIFT (STORE_MIN_SHIFT + STORE_CLASSES - 1)
+
+struct storeBlock {
+	struct storeBlock *next, *prev;
+	max_align_t data[];
+};
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+struct {
+	struct storeBlock slabs; // list of slabs
+	struct storeBlock big;   // list of blocks above the largest class
+	char *bump, *end;        // unused part of the newest slab
+	void *free[STORE_CLASSES];
+} store = {
+	.slabs = {&store.slabs, &store.slabs},
+	.big = {&store.big, &store.big},
+};
 
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+struct storeBlock *storeLink(struct storeBlock *list, struct storeBlock *b) {
+	if (b == NULL)
+		die("malloc");
+	b->next = list->next;
+	b->prev = list;
+	list->next->prev = b;
+	list->next = b;
+	return b;
+}
 
-	int i = 0;
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void storeUnlink(struct storeBlock *b) {
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
 
-		if (scs_len && !in_string && !in_comment)
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
+struct storeBlock *storeBlockOf(void *p) {
+	return (struct storeBlock *)((char *)p - offsetof(struct storeBlock, data));
+}
 
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				} else {
-					i++;
-					continue;
-				}
-			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
+/* Returns a block of at least `size` bytes; *shift receives log2 of its size. */
+void *storeAlloc(int size, unsigned char *shift) {
+	int k = STORE_MIN_SHIFT;
+	while ((1L << k) < size)
+		k++;
+	*shift = k;
+	if (k > STORE_MAX_SHIFT) {
+		struct storeBlock *b = malloc(sizeof(struct storeBlock) + (1L << k));
+		return storeLink(&store.big, b)->data;
+	}
+	int c = k - STORE_MIN_SHIFT;
+	void *p = store.free[c];
+	if (p) {
+		store.free[c] = *(void **)p;
+		return p;
+	}
+	if (store.end - store.bump < (1 << k)) {
+		/* hand the rest of the slab to the free lists before starting anew */
+		for (c = STORE_CLASSES - 1; c >= 0; c--) {
+			while (store.end - store.bump >= (1 << (c + STORE_MIN_SHIFT))) {
+				*(void **)store.bump = store.free[c];
+				store.free[c] = store.bump;
+				store.bump += 1 << (c + STORE_MIN_SHIFT);
 			}
 		}
+		struct storeBlock *slab = malloc(sizeof(struct storeBlock) + STORE_SLAB_SIZE);
+		store.bump = (char *)storeLink(&store.slabs, slab)->data;
+		store.end = store.bump + STORE_SLAB_SIZE;
+	}
+	p = store.bump;
+	store.bump += 1 << k;
+	return p;
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string)
-					in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			} else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
-		}
+void storeFree(void *p, unsigned char shift) {
+	if (p == NULL || shift == 0)
+		return;
+	if (shift > STORE_MAX_SHIFT) {
+		struct storeBlock *b = storeBlockOf(p);
+		storeUnlink(b);
+		free(b);
+		return;
+	}
+	int c = shift - STORE_MIN_SHIFT;
+	*(void **)p = store.free[c];
+	store.free[c] = p;
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if (isdigit(c) && (prev_sep || prev_hl == HL_NUMBER) ||
-					(c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
-		}
+/* Grows a block to hold `size` bytes, keeping its contents; like realloc,
+ * p may be NULL. Blocks never shrink. */
+void *storeResize(void *p, unsigned char *shift, int size) {
+	if (*shift && size <= (1L << *shift))
+		return p;
+	if (*shift > STORE_MAX_SHIFT) {
+		struct storeBlock *b = storeBlockOf(p);
+		storeUnlink(b);
+		while ((1L << *shift) < size)
+			(*shift)++;
+		b = realloc(b, sizeof(struct storeBlock) + (1L << *shift));
+		return storeLink(&store.big, b)->data;
+	}
+	unsigned char old = *shift;
+	void *q = storeAlloc(size, shift);
+	if (p)
+		memcpy(q, p, 1 << old);
+	storeFree(p, old);
+	return q;
+}
 
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2) klen--;
-
-				if (!strncmp(&row->render[i], keywords[j], klen) &&
-						is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
-			}
+/* Releases every block at once. */
+void storeReset() {
+	struct storeBlock *lists[] = {&store.slabs, &store.big};
+	for (int i = 0; i < 2; i++) {
+		struct storeBlock *b = lists[i]->next;
+		while (b != lists[i]) {
+			struct storeBlock *next = b->next;
+			free(b);
+			b = next;
 		}
-
-		prev_sep = is_separator(c);
-		i++;
+		lists[i]->next = lists[i]->prev = lists[i];
 	}
+	store.bump = store.end = NULL;
+	memset(store.free, 0, sizeof(store.free));
+}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows)
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+/* buffer */
+ropeNode *ropeNewNode(bool leaf) {
+	ropeNode *node;
+	if (leaf)
+		node = aligned_alloc(ROPE_LEAF_SIZE, ROPE_LEAF_SIZE);
+	else
+		node = malloc(sizeof(ropeNode));
+	if (node == NULL)
+		die("malloc");
+	node->parent = NULL;
+	node->count = 0;
+	node->n = 0;
+	node->leaf = leaf;
+	return node;
 }
 
-int editorSyntaxToColor(int hl) {
-	switch (hl) {
-		case HL_COMMENT:
-		case HL_MLCOMMENT:
-			return 36;
-		case HL_KEYWORD1:
-			return 33;
-		case HL_KEYWORD2:
-			return 32;
-		case HL_STRING:
-			return 35;
-		case HL_NUMBER:
-			return 31;
-		case HL_MATCH:
-			return 34;
-		default:
-			return 37;
+void ropeFreeNode(ropeNode *node) {
+	if (!node->leaf)
+		for (int i = 0; i < node->n; i++)
+			ropeFreeNode(node->u.child[i]);
+	free(node);
+}
+
+int ropeChildIndex(ropeNode *parent, ropeNode *child) {
+	int i = 0;
+	while (parent->u.child[i] != child)
+		i++;
+	return i;
+}
+
+/* Returns the leaf holding row `at` and its offset inside it; at == E.numrows
+ * resolves to the end of the last leaf. */
+ropeNode *ropeFind(int at, int *off) {
+	ropeNode *node = E.rope;
+	if (at == node->count) {
+		while (!node->leaf)
+			node = node->u.child[node->n - 1];
+		*off = node->n;
+		return node;
 	}
-}	
+	while (!node->leaf) {
+		int i;
+		for (i = 0; i < node->n - 1 && at >= node->u.child[i]->count; i++)
+			at -= node->u.child[i]->count;
+		node = node->u.child[i];
+	}
+	*off = at;
+	return node;
+}
 
-void editorSelectSyntaxHighlight() {
-	E.syntax = NULL;
-	if (E.filename == NULL)
-		return;
+void ropeAddCount(ropeNode *node, int delta) {
+	for (; node; node = node->parent)
+		node->count += delta;
+}
 
-	char *ext = strrchr(E.filename, '.');
+/* Moves entries [mid, n) of a full node into a new right sibling and hooks
+ * the sibling into the parent, splitting upwards as needed. */
+ropeNode *ropeSplit(ropeNode *node, int mid) {
+	ropeNode *right = ropeNewNode(node->leaf);
+	int moved = node->n - mid;
+	if (node->leaf) {
+		memcpy(right->u.row, &node->u.row[mid], sizeof(erow) * moved);
+		right->count = moved;
+	} else {
+		memcpy(right->u.child, &node->u.child[mid], sizeof(ropeNode *) * moved);
+		for (int i = 0; i < moved; i++) {
+			right->u.child[i]->parent = right;
+			right->count += right->u.child[i]->count;
+		}
+	}
+	right->n = moved;
+	node->n = mid;
+	node->count -= right->count;
+	ropeAddCount(node->parent, -right->count);
+
+	ropeNode *parent = node->parent;
+	if (parent == NULL) {
+		parent = ropeNewNode(false);
+		parent->u.child[0] = node;
+		parent->n = 1;
+		parent->count = node->count;
+		node->parent = parent;
+		E.rope = parent;
+	}
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-				(!is_ext && strstr(E.filename, s->filematch[i]))) {
-				E.syntax = s;
+	int pos = ropeChildIndex(parent, node) + 1;
+	if (parent->n == ROPE_FANOUT) {
+		ropeNode *pright = ropeSplit(parent, pos == parent->n ? parent->n : parent->n / 2);
+		if (pos > parent->n || parent->n == ROPE_FANOUT) {
+			pos -= parent->n;
+			parent = pright;
+		}
+	}
+	memmove(&parent->u.child[pos + 1], &parent->u.child[pos],
+			sizeof(ropeNode *) * (parent->n - pos));
+	parent->u.child[pos] = right;
+	parent->n++;
+	right->parent = parent;
+	ropeAddCount(parent, right->count);
+	return right;
+}
 
-				int filerow;
-				for (filerow = 0; filerow < E.rowoff; filerow++)
-					editorUpdateSyntax(&E.row[filerow]);
-				for (; filerow < E.rowoff + E.screenrows; filerow++) {
-					editorUpdateSyntax(&E.row[filerow]);
-					E.row[filerow].damaged = true;
-				}
-				for (; filerow < E.numrows; filerow++)
-					editorUpdateSyntax(&E.row[filerow]);
-				return;
-			}
-			i++;
+/* Opens a slot for a new row at `at` and returns it uninitialized. */
+erow *ropeInsert(int at) {
+	int off;
+	ropeNode *leaf = ropeFind(at, &off);
+	if (leaf->n == ROPE_LEAF_ROWS) {
+		/* appending fills leaves completely, like a file being loaded */
+		ropeNode *right = ropeSplit(leaf, off == leaf->n ? leaf->n : leaf->n / 2);
+		if (off > leaf->n || leaf->n == ROPE_LEAF_ROWS) {
+			off -= leaf->n;
+			leaf = right;
 		}
 	}
+	memmove(&leaf->u.row[off + 1], &leaf->u.row[off], sizeof(erow) * (leaf->n - off));
+	leaf->n++;
+	ropeAddCount(leaf, 1);
+	return &leaf->u.row[off];
 }
 
-/* row operations */
-int editorRowCxToRx(erow *row, int cx) {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t')
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		rx++;
+void ropeDelete(int at) {
+	int off;
+	ropeNode *node = ropeFind(at, &off);
+	memmove(&node->u.row[off], &node->u.row[off + 1], sizeof(erow) * (node->n - off - 1));
+	node->n--;
+	ropeAddCount(node, -1);
+
+	/* unlink emptied chunks, then drop single-child roots */
+	while (node->n == 0 && node->parent) {
+		ropeNode *parent = node->parent;
+		int i = ropeChildIndex(parent, node);
+		memmove(&parent->u.child[i], &parent->u.child[i + 1],
+				sizeof(ropeNode *) * (parent->n - i - 1));
+		parent->n--;
+		free(node);
+		node = parent;
+	}
+	while (!E.rope->leaf && E.rope->n <= 1) {
+		ropeNode *root = E.rope;
+		E.rope = root->n ? root->u.child[0] : ropeNewNode(true);
+		E.rope->parent = NULL;
+		free(root);
 	}
-	return rx;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-	int cur_rx = 0;
-	int old_rx;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		old_rx = cur_rx;
-		if (row->chars[cx] == '\t')
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
+ropeNode *ropeNextLeaf(ropeNode *node) {
+	for (; node->parent; node = node->parent) {
+		ropeNode *parent = node->parent;
+		int i = ropeChildIndex(parent, node);
+		if (i + 1 < parent->n) {
+			node = parent->u.child[i + 1];
+			while (!node->leaf)
+				node = node->u.child[0];
+			return node;
+		}
+	}
+	return NULL;
+}
 
-		if (cur_rx > rx) {
-			if (rx - old_rx > cur_rx - rx)
-				return cx + 1;
-			return cx;
+ropeNode *ropePrevLeaf(ropeNode *node) {
+	for (; node->parent; node = node->parent) {
+		ropeNode *parent = node->parent;
+		int i = ropeChildIndex(parent, node);
+		if (i > 0) {
+			node = parent->u.child[i - 1];
+			while (!node->leaf)
+				node = node->u.child[node->n - 1];
+			return node;
 		}
 	}
-	return cx;
+	return NULL;
 }
 
-void editorUpdateRow(erow *row) {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t')
-			tabs++;
+erow *editorRowAt(int at) {
+	if (at < 0 || at >= E.numrows)
+		return NULL;
+	int off;
+	ropeNode *leaf = ropeFind(at, &off);
+	return &leaf->u.row[off];
+}
 
-	free(row->render);
-	row->render = malloc(row->size + (KILO_TAB_STOP - 1) * tabs + 1);
+ropeNode *ropeLeafOf(erow *row) {
+	return (ropeNode *)((uintptr_t)row & ~(uintptr_t)(ROPE_LEAF_SIZE - 1));
+}
 
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0)
-				row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
-		}
-	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+erow *editorRowNext(erow *row) {
+	ropeNode *leaf = ropeLeafOf(row);
+	if (row + 1 < &leaf->u.row[leaf->n])
+		return row + 1;
+	leaf = ropeNextLeaf(leaf);
+	return leaf ? &leaf->u.row[0] : NULL;
+}
 
-	row->damaged = true;
+erow *editorRowPrev(erow *row) {
+	ropeNode *leaf = ropeLeafOf(row);
+	if (row > &leaf->u.row[0])
+		return row - 1;
+	leaf = ropePrevLeaf(leaf);
+	return leaf ? &leaf->u.row[leaf->n - 1] : NULL;
+}
 
-	editorUpdateSyntax(row);
+int editorRowIndex(erow *row) {
+	ropeNode *node = ropeLeafOf(row);
+	int idx = row - node->u.row;
+	for (; node->parent; node = node->parent)
+		for (int i = 0; node->parent->u.child[i] != node; i++)
+			idx += node->parent->u.child[i]->count;
+	return idx;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-	if (at < 0 || at > E.numrows) return;
+/* syntax hightlighting */
+#define CC_SEP     (1<<0) // ends a keyword
+#define CC_DIGIT   (1<<1)
+#define CC_QUOTE   (1<<2)
+#define CC_COMMENT (1<<3) // may start a comment delimiter
+
+#define SYNTAX_SEPARATORS ",.()+-/*=~%<>[];"
+
+unsigned int syntaxHash(const char *s, int len) {
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+/* Builds the character-class table and the keyword hash table used by
+ * editorSyntaxLex(), so lexing cost no longer grows with the keyword list. */
+void editorSyntaxCompile(struct editorSyntax *s) {
+	const char *separators = s->separators ? s->separators : SYNTAX_SEPARATORS;
+
+	memset(s->cclass, 0, sizeof(s->cclass));
+	s->cclass[0] |= CC_SEP;
+	for (int c = 1; c < 256; c++) {
+		if (isspace(c) || strchr(separators, c))
+			s->cclass[c] |= CC_SEP;
+		if ((s->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c))
+			s->cclass[c] |= CC_DIGIT;
+	}
+	if (s->flags & HL_HIGHLIGHT_STRINGS) {
+		s->cclass['"'] |= CC_QUOTE;
+		s->cclass['\''] |= CC_QUOTE;
+	}
 
-	int j;
-	for (j = at + 1; j - E.rowoff < E.screenrows && j <= E.numrows; j++) {
-		E.row[j].idx++;
-		E.row[j].damaged = true;
+	s->scs_len = s->singleline_comment_start ? strlen(s->singleline_comment_start) : 0;
+	s->mcs_len = s->multiline_comment_start ? strlen(s->multiline_comment_start) : 0;
+	s->mce_len = s->multiline_comment_end ? strlen(s->multiline_comment_end) : 0;
+	if (!s->mcs_len || !s->mce_len)
+		s->mcs_len = s->mce_len = 0;
+	if (s->scs_len)
+		s->cclass[(unsigned char)s->singleline_comment_start[0]] |= CC_COMMENT;
+	if (s->mcs_len)
+		s->cclass[(unsigned char)s->multiline_comment_start[0]] |= CC_COMMENT;
+
+	int nkeywords = 0;
+	while (s->keywords && s->keywords[nkeywords])
+		nkeywords++;
+	unsigned int size = 8;
+	while (size < 2 * (unsigned int)nkeywords)
+		size *= 2;
+	s->kwtable = calloc(size, sizeof(struct syntaxKeyword));
+	s->kwmask = size - 1;
+	s->kw_maxlen = 0;
+	for (int j = 0; j < nkeywords; j++) {
+		int len = strlen(s->keywords[j]);
+		int kw2 = len > 1 && s->keywords[j][len - 1] == '|';
+		if (kw2)
+			len--;
+		if (len == 0)
+			continue;
+		unsigned int h = syntaxHash(s->keywords[j], len) & s->kwmask;
+		while (s->kwtable[h].word)
+			h = (h + 1) & s->kwmask;
+		s->kwtable[h].word = s->keywords[j];
+		s->kwtable[h].len = len;
+		s->kwtable[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+		if (len > s->kw_maxlen)
+			s->kw_maxlen = len;
 	}
-	for (; j <= E.numrows; j++)
-		E.row[j].idx++;
+}
 
-	E.row[at].idx = at;
-	
-	E.row[at].size = len;
-	E.row[at].chars = malloc((len + 1) * sizeof(char));
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+int editorSyntaxKeyword(struct editorSyntax *s, const char *word, int len) {
+	if (len > s->kw_maxlen)
+		return HL_NORMAL;
+	unsigned int h = syntaxHash(word, len) & s->kwmask;
+	for (; s->kwtable[h].word; h = (h + 1) & s->kwmask)
+		if (s->kwtable[h].len == len && !memcmp(s->kwtable[h].word, word, len))
+			return s->kwtable[h].hl;
+	return HL_NORMAL;
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
+/* Lexes text[from..len), filling hl and returning the comment state the
+ * line ends in. Lexing starts at `from` in state `in_comment`; from > 0 must
+ * follow a plain separator, where nothing carries over but the comment
+ * state. If `old` holds the previous hl of the text after `settle`, lexing
+ * stops as soon as it is back in a plain state that old was also in, the
+ * rest of old is copied and -1 is returned: the end state did not change. */
+int editorSyntaxLexRange(struct editorSyntax *s, const char *text, int len,
+		unsigned char *hl, int from, int in_comment,
+		const unsigned char *old, int settle) {
+	memset(&hl[from], HL_NORMAL, len - from);
+
+	if (s == NULL)
+		return 0;
+	const unsigned char *cclass = s->cclass;
 
-	editorUpdateRow(&E.row[at]);
+	int prev_sep = 1;
+	int in_string = 0;
 
-	E.numrows++;
-	E.dirty++;
-}	
+	int i = from;
+	while (i < len) {
+		unsigned char c = text[i];
+		unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
-void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
-}
+		if (old && i > settle && !in_comment && !in_string && prev_sep &&
+				prev_hl == HL_NORMAL && old[i - 1 - settle] == HL_NORMAL) {
+			memcpy(&hl[i], &old[i - settle], len - i);
+			return -1;
+		}
 
-void editorDelRow(int at) {
-	if (at < 0 || at >= E.numrows)
-		return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	int j;
-	for (j = at; j - E.rowoff < E.screenrows && j < E.numrows - 1; j++) {
-		E.row[j].idx--;
-		E.row[j].damaged = true;
+		if (in_comment) {
+			char *end = memmem(&text[i], len - i, s->multiline_comment_end, s->mce_len);
+			int stop = end ? (end - text) + s->mce_len : len;
+			memset(&hl[i], HL_MLCOMMENT, stop - i);
+			i = stop;
+			if (end) {
+				in_comment = 0;
+				prev_sep = 1;
+			}
+			continue;
+		}
+
+		if (!in_string && (cclass[c] & CC_COMMENT)) {
+			if (s->scs_len && i + s->scs_len <= len &&
+					!memcmp(&text[i], s->singleline_comment_start, s->scs_len)) {
+				memset(&hl[i], HL_COMMENT, len - i);
+				break;
+			}
+			if (s->mcs_len && i + s->mcs_len <= len &&
+					!memcmp(&text[i], s->multiline_comment_start, s->mcs_len)) {
+				memset(&hl[i], HL_MLCOMMENT, s->mcs_len);
+				i += s->mcs_len;
+				in_comment = 1;
+				continue;
+			}
+		}
+
+		if (in_string) {
+			hl[i] = HL_STRING;
+			if (c == '\\' && i + 1 < len) {
+				hl[i + 1] = HL_STRING;
+				i += 2;
+				continue;
+			}
+			if (c == in_string)
+				in_string = 0;
+			i++;
+			prev_sep = 1;
+			continue;
+		} else if (cclass[c] & CC_QUOTE) {
+			in_string = c;
+			hl[i] = HL_STRING;
+			i++;
+			continue;
+		}
+
+		if ((cclass[c] & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER) ||
+				(c == '.' && prev_hl == HL_NUMBER)) {
+			hl[i] = HL_NUMBER;
+			i++;
+			prev_sep = 0;
+			continue;
+		}
+
+		if (prev_sep && !(cclass[c] & CC_SEP)) {
+			int end = i + 1;
+			while (end < len && !(cclass[(unsigned char)text[end]] & CC_SEP))
+				end++;
+			int kw = editorSyntaxKeyword(s, &text[i], end - i);
+			if (kw != HL_NORMAL) {
+				memset(&hl[i], kw, end - i);
+				i = end;
+				prev_sep = 0;
+				continue;
+			}
+		}
+
+		prev_sep = cclass[c] & CC_SEP;
+		i++;
+	}
+
+	return in_comment;
+}
+
+/* Lexes one line starting in comment state `in_comment`, filling hl[0..len)
+ * and returning the state the line ends in. */
+int editorSyntaxLex(struct editorSyntax *s, const char *text, int len,
+		unsigned char *hl, int in_comment) {
+	return editorSyntaxLexRange(s, text, len, hl, 0, in_comment, NULL, 0);
+}
+
+/* Appends a copy of `word` (plus `suffix`) to a NULL-terminated list. */
+char **syntaxListAppend(char **list, const char *word, const char *suffix) {
+	int n = 0;
+	while (list && list[n])
+		n++;
+	list = realloc(list, sizeof(char *) * (n + 2));
+	list[n] = malloc(strlen(word) + strlen(suffix) + 1);
+	strcpy(list[n], word);
+	strcat(list[n], suffix);
+	list[n + 1] = NULL;
+	return list;
+}
+
+void syntaxListFree(char **list) {
+	for (int i = 0; list && list[i]; i++)
+		free(list[i]);
+	free(list);
+}
+
+/* Adds a definition to syntaxdb, which takes over its strings. One read
+ * from a file without a filetype or match line is freed instead. */
+void editorSyntaxAdd(struct editorSyntax *s) {
+	if (s->filetype == NULL || s->filematch == NULL) {
+		free(s->filetype);
+		syntaxListFree(s->filematch);
+		syntaxListFree(s->keywords);
+		free(s->singleline_comment_start);
+		free(s->multiline_comment_start);
+		free(s->multiline_comment_end);
+		free(s->separators);
+		return;
+	}
+	syntaxdb = realloc(syntaxdb, sizeof(struct editorSyntax) * (syntaxdb_entries + 1));
+	syntaxdb[syntaxdb_entries] = *s;
+	editorSyntaxCompile(&syntaxdb[syntaxdb_entries]);
+	syntaxdb_entries++;
+}
+
+/* Reads syntax definitions from a file. Each line is a key followed by
+ * whitespace-separated values, and every "filetype NAME" line starts a new
+ * definition. The other keys are "match" (extensions or name fragments),
+ * "keywords", "types", "comment START", "multiline_comment START END",
+ * "separators CHARS" and "highlight numbers strings". See syntax/c.syntax. */
+void editorLoadSyntaxFile(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	struct editorSyntax def = {0};
+	char *line = NULL;
+	size_t linecap = 0;
+	while (getline(&line, &linecap, fp) != -1) {
+		const char *delim = " \t\r\n";
+		char *save;
+		char *key = strtok_r(line, delim, &save);
+		char *arg = key ? strtok_r(NULL, delim, &save) : NULL;
+		if (key == NULL || key[0] == '#' || arg == NULL)
+			continue;
+
+		if (!strcmp(key, "filetype")) {
+			editorSyntaxAdd(&def);
+			memset(&def, 0, sizeof(def));
+			def.filetype = strdup(arg);
+		} else if (!strcmp(key, "match")) {
+			for (; arg; arg = strtok_r(NULL, delim, &save))
+				def.filematch = syntaxListAppend(def.filematch, arg, "");
+		} else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+			const char *suffix = key[0] == 't' ? "|" : "";
+			for (; arg; arg = strtok_r(NULL, delim, &save))
+				def.keywords = syntaxListAppend(def.keywords, arg, suffix);
+		} else if (!strcmp(key, "comment")) {
+			def.singleline_comment_start = strdup(arg);
+		} else if (!strcmp(key, "multiline_comment")) {
+			char *end = strtok_r(NULL, delim, &save);
+			if (end) {
+				def.multiline_comment_start = strdup(arg);
+				def.multiline_comment_end = strdup(end);
+			}
+		} else if (!strcmp(key, "separators")) {
+			def.separators = strdup(arg);
+		} else if (!strcmp(key, "highlight")) {
+			for (; arg; arg = strtok_r(NULL, delim, &save)) {
+				if (!strcmp(arg, "numbers"))
+					def.flags |= HL_HIGHLIGHT_NUMBERS;
+				else if (!strcmp(arg, "strings"))
+					def.flags |= HL_HIGHLIGHT_STRINGS;
+			}
+		}
+	}
+	editorSyntaxAdd(&def);
+	free(line);
+	fclose(fp);
+}
+
+int syntaxFileFilter(const struct dirent *ent) {
+	size_t len = strlen(ent->d_name);
+	return len > 7 && !strcmp(&ent->d_name[len - 7], ".syntax");
+}
+
+/* Loads *.syntax files from $KILO_SYNTAX_DIR (default ~/.kilo/syntax) in
+ * name order, followed by the built-in definitions, so a file can
+ * override a built-in filetype without recompiling. */
+void editorLoadSyntaxes() {
+	char dir[PATH_MAX];
+	const char *env = getenv("KILO_SYNTAX_DIR");
+	if (env)
+		snprintf(dir, sizeof(dir), "%s", env);
+	else
+		snprintf(dir, sizeof(dir), "%s/.kilo/syntax", getenv("HOME") ? getenv("HOME") : ".");
+
+	struct dirent **names;
+	int n = scandir(dir, &names, syntaxFileFilter, alphasort);
+	for (int i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		int len = snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+		if (len >= 0 && len < (int)sizeof(path))
+			editorLoadSyntaxFile(path);
+		free(names[i]);
+	}
+	if (n >= 0)
+		free(names);
+
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+		editorSyntaxAdd(&HLDB[j]);
+}
+
+/* Computes only the comment state a line ends in, without building its hl.
+ * Lines that cannot open or close a comment are answered with a memmem. */
+int editorSyntaxLexState(struct editorSyntax *s, const char *text, int len, int in_comment) {
+	static __thread unsigned char *scratch = NULL;
+	static __thread int scratch_size = 0;
+
+	if (s == NULL || s->mcs_len == 0)
+		return 0;
+	if (in_comment) {
+		if (memmem(text, len, s->multiline_comment_end, s->mce_len) == NULL)
+			return 1;
+	} else {
+		if (memmem(text, len, s->multiline_comment_start, s->mcs_len) == NULL)
+			return 0;
+	}
+
+	if (len > scratch_size) {
+		scratch_size = len * 2;
+		scratch = realloc(scratch, scratch_size);
+	}
+	return editorSyntaxLex(s, text, len, scratch, in_comment);
+}
+
+/* Returns a per-thread buffer of at least `len` bytes, keeping its contents. */
+unsigned char *editorHlScratch(int len) {
+	static __thread unsigned char *buf = NULL;
+	static __thread int cap = 0;
+	if (len > cap) {
+		cap = len * 2;
+		buf = realloc(buf, cap);
+		if (buf == NULL)
+			die("realloc");
+	}
+	return buf;
+}
+
+hlSpan *editorRowSpans(erow *row) {
+	return row->hlcap ? row->hl : row->hl_inline;
+}
+
+/* Expands the runs of a row into one byte per render column, in a buffer
+ * that stays valid until the next call; hl[rsize] reads as HL_NORMAL. */
+unsigned char *editorRowHl(erow *row) {
+	unsigned char *hl = editorHlScratch(row->rsize + 1);
+	int j = 0;
+	for (hlSpan *sp = editorRowSpans(row); j < row->rsize; sp++) {
+		memset(&hl[j], *sp & 0xff, *sp >> 8);
+		j += *sp >> 8;
+	}
+	hl[j] = HL_NORMAL;
+	return hl;
+}
+
+/* Encodes hl[0..len) as runs, in a buffer that stays valid until the
+ * next call; sets *count to their number. */
+hlSpan *editorHlSpans(const unsigned char *hl, int len, int *count) {
+	static __thread hlSpan *spans = NULL;
+	static __thread int cap = 0;
+	if (len > cap) {
+		cap = len * 2;
+		spans = realloc(spans, cap * sizeof(hlSpan));
+		if (spans == NULL)
+			die("realloc");
+	}
+	int n = 0;
+	for (int j = 0; j < len; n++) {
+		int run = editorHlRun(&hl[j], len - j < HL_SPAN_MAX ? len - j : HL_SPAN_MAX);
+		spans[n] = (hlSpan)run << 8 | hl[j];
+		j += run;
+	}
+	*count = n;
+	return spans;
+}
+
+/* Stores hl[0..rsize) in the row as runs. */
+void editorRowSetHl(erow *row, const unsigned char *hl) {
+	int n;
+	hlSpan *spans = editorHlSpans(hl, row->rsize, &n);
+	if (n <= 2) {
+		storeFree(row->hl, row->hlcap);
+		row->hlcap = 0;
+	} else {
+		if (row->hlcap == 0)
+			row->hl = NULL;
+		row->hl = storeResize(row->hl, &row->hlcap, n * sizeof(hlSpan));
+	}
+	memcpy(editorRowSpans(row), spans, n * sizeof(hlSpan));
+}
+
+/* Re-lexes a row whose line starts in state `in_comment`. Rows that were
+ * never drawn only get their comment state; hl is built with render. */
+void editorSyntaxLexRow(erow *row, int in_comment) {
+	if (row->render) {
+		unsigned char *hl = editorHlScratch(row->rsize + 1);
+		row->hl_open_comment = editorSyntaxLex(E.syntax, row->render, row->rsize,
+				hl, in_comment);
+		editorRowSetHl(row, hl);
+	} else {
+		row->hl_open_comment = editorSyntaxLexState(E.syntax, row->chars, row->size, in_comment);
+	}
+	row->hl_in = in_comment;
+	row->hl_valid = true;
+}
+
+/* Rows below E.hl_checked may start in a stale comment state; they are
+ * re-checked lazily by editorSyntaxResolve(). */
+void editorSyntaxInvalidate(int at) {
+	if (at < E.hl_checked)
+		E.hl_checked = at;
+}
+
+/* Brings the comment state of rows [0, upto) up to date, resuming from the
+ * last checkpoint. Rows whose cached starting state still matches are
+ * skipped without lexing. */
+void editorSyntaxResolve(int upto) {
+	if (upto > E.numrows)
+		upto = E.numrows;
+	if (E.syntax == NULL || E.hl_checked >= upto)
+		return;
+
+	erow *row = editorRowAt(E.hl_checked);
+	erow *prev = editorRowPrev(row);
+	int in_comment = prev ? prev->hl_open_comment : 0;
+	for (; E.hl_checked < upto; E.hl_checked++, row = editorRowNext(row)) {
+		if (!row->hl_valid || row->hl_in != in_comment)
+			editorSyntaxLexRow(row, in_comment);
+		in_comment = row->hl_open_comment;
+	}
+}
+
+bool editorSyntaxPending() {
+	return E.syntax != NULL && E.hl_checked < E.numrows;
+}
+
+/* Highlights a row in the state its predecessor currently ends in. Rows
+ * below are not touched: their cached starting state is compared against
+ * this row's end state when they are next resolved. */
+void editorUpdateSyntax(erow *row) {
+	erow *prev = editorRowPrev(row);
+	int was_valid = row->hl_valid;
+	int open_comment = row->hl_open_comment;
+
+	editorSyntaxLexRow(row, prev ? prev->hl_open_comment : 0);
+	if (!was_valid || row->hl_open_comment != open_comment)
+		editorSyntaxInvalidate(editorRowIndex(row) + 1);
+}
+
+int editorSyntaxToColor(int hl) {
+	switch (hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT:
+			return 36;
+		case HL_KEYWORD1:
+			return 33;
+		case HL_KEYWORD2:
+			return 32;
+		case HL_STRING:
+			return 35;
+		case HL_NUMBER:
+			return 31;
+		case HL_MATCH:
+			return 34;
+		default:
+			return 37;
+	}
+}	
+
+void editorSelectSyntaxHighlight() {
+	E.syntax = NULL;
+	if (E.filename == NULL)
+		return;
+
+	char *ext = strrchr(E.filename, '.');
+
+	for (unsigned int j = 0; j < syntaxdb_entries; j++) {
+		struct editorSyntax *s = &syntaxdb[j];
+		unsigned int i = 0;
+		while (s->filematch[i]) {
+			int is_ext = (s->filematch[i][0] == '.');
+			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+				(!is_ext && strstr(E.filename, s->filematch[i]))) {
+				E.syntax = s;
+
+				/* rows get re-lexed as they come into view */
+				for (erow *row = editorRowAt(0); row; row = editorRowNext(row))
+					row->hl_valid = false;
+				E.hl_checked = 0;
+				return;
+			}
+			i++;
+		}
+	}
+}
+
+/* background highlighting */
+
+/* Rows copied out of the buffer so they can be lexed without the lock. */
+struct hlBatch {
+	struct editorSyntax *syntax;
+	int start;
+	int count;
+	int in_comment;
+	unsigned int version[KILO_HL_BATCH_ROWS];
+	bool rendered[KILO_HL_BATCH_ROWS];
+	unsigned char out[KILO_HL_BATCH_ROWS];
+	size_t offset[KILO_HL_BATCH_ROWS + 1];
+	char *text;
+	unsigned char *hl;
+	size_t cap;
+};
+
+void editorLock() {
+	pthread_mutex_lock(&E.lock);
+}
+
+void editorUnlock() {
+	pthread_mutex_unlock(&E.lock);
+}
+
+/* Moves the checkpoint over rows that already start in the right state,
+ * then copies out the rows that need lexing. */
+void hlBatchFill(struct hlBatch *b) {
+	erow *row = editorRowAt(E.hl_checked);
+	erow *prev = editorRowPrev(row);
+	int in_comment = prev ? prev->hl_open_comment : 0;
+	for (int skipped = 0; row && row->hl_valid && row->hl_in == in_comment; skipped++) {
+		if (skipped == KILO_HL_BATCH_ROWS * 16) {
+			b->count = 0;
+			return;
+		}
+		in_comment = row->hl_open_comment;
+		row = editorRowNext(row);
+		E.hl_checked++;
+	}
+
+	b->syntax = E.syntax;
+	b->start = E.hl_checked;
+	b->in_comment = in_comment;
+
+	size_t used = 0;
+	int n;
+	for (n = 0; row && n < KILO_HL_BATCH_ROWS; n++, row = editorRowNext(row)) {
+		char *text = row->render ? row->render : row->chars;
+		size_t len = row->render ? row->rsize : row->size;
+		if (n > 0 && used + len > KILO_HL_BATCH_BYTES)
+			break;
+		if (used + len > b->cap) {
+			b->cap = (used + len) * 2;
+			b->text = realloc(b->text, b->cap);
+			b->hl = realloc(b->hl, b->cap);
+		}
+		memcpy(&b->text[used], text, len);
+		b->offset[n] = used;
+		b->version[n] = row->version;
+		b->rendered[n] = row->render != NULL;
+		used += len;
+	}
+	b->offset[n] = used;
+	b->count = n;
+}
+
+void hlBatchLex(struct hlBatch *b) {
+	int in_comment = b->in_comment;
+	for (int i = 0; i < b->count; i++) {
+		char *text = &b->text[b->offset[i]];
+		int len = b->offset[i + 1] - b->offset[i];
+		if (b->rendered[i])
+			in_comment = editorSyntaxLex(b->syntax, text, len, &b->hl[b->offset[i]], in_comment);
+		else
+			in_comment = editorSyntaxLexState(b->syntax, text, len, in_comment);
+		b->out[i] = in_comment;
+	}
+}
+
+/* Installs the lexed rows, stopping at the first one that was edited (its
+ * version moved) or rendered since the batch was copied. Nothing is
+ * published if the checkpoint or the state before the batch changed. */
+void hlBatchPublish(struct hlBatch *b) {
+	if (b->count == 0 || E.syntax != b->syntax || E.hl_checked != b->start || b->start >= E.numrows)
+		return;
+	erow *row = editorRowAt(b->start);
+	erow *prev = editorRowPrev(row);
+	if ((prev ? prev->hl_open_comment : 0) != b->in_comment)
+		return;
+
+	int in_comment = b->in_comment;
+	for (int i = 0; i < b->count && row; i++, row = editorRowNext(row)) {
+		if (row->version != b->version[i] || (row->render != NULL) != b->rendered[i])
+			break;
+		if (!row->hl_valid || row->hl_in != in_comment) {
+			if (b->rendered[i])
+				editorRowSetHl(row, &b->hl[b->offset[i]]);
+			row->hl_open_comment = b->out[i];
+			row->hl_in = in_comment;
+			row->hl_valid = true;
+		}
+		in_comment = row->hl_open_comment;
+		E.hl_checked++;
+	}
+}
+
+/* Highlights the rows below the checkpoint while the main thread waits for
+ * keys; the viewport itself is always resolved by editorRefreshScreen(). */
+void *editorHighlightWorker(void *arg) {
+	(void)arg;
+	struct hlBatch *b = calloc(1, sizeof(struct hlBatch));
+
+	editorLock();
+	while (1) {
+		while (!editorSyntaxPending())
+			pthread_cond_wait(&E.hl_cond, &E.lock);
+		hlBatchFill(b);
+		editorUnlock();
+		hlBatchLex(b);
+		/* a pending key always wins the lock */
+		while (atomic_load(&E.lock_wanted))
+			sched_yield();
+		editorLock();
+		hlBatchPublish(b);
+	}
+	return NULL;
+}
+
+void editorStartHighlighter() {
+	/* SIGWINCH must be handled by the main thread */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, editorHighlightWorker, NULL) != 0)
+		die("pthread_create");
+	pthread_detach(thread);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* vector kernels */
+/* Byte scans used when rendering and drawing rows. With SSE2 they work on
+ * 16 bytes at a time, or 32 when the CPU has AVX2; otherwise plain loops. */
+#ifdef KILO_SIMD
+static bool simd_avx2;
+
+__attribute__((target("avx2")))
+static int avx2CountByte(const char *s, int len, char c) {
+	__m256i needle = _mm256_set1_epi8(c);
+	int n = 0;
+	int j = 0;
+	for (; j + 32 <= len; j += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&s[j]);
+		n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+	}
+	for (; j < len; j++)
+		n += s[j] == c;
+	return n;
+}
+
+static int sse2CountByte(const char *s, int len, char c) {
+	__m128i needle = _mm_set1_epi8(c);
+	int n = 0;
+	int j = 0;
+	for (; j + 16 <= len; j += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+	}
+	for (; j < len; j++)
+		n += s[j] == c;
+	return n;
+}
+
+/* control characters are 0..31 and 127: min(v, 31) == v catches the first */
+__attribute__((target("avx2")))
+static int avx2FindCntrl(const char *s, int len) {
+	__m256i low = _mm256_set1_epi8(31);
+	__m256i del = _mm256_set1_epi8(127);
+	int j = 0;
+	for (; j + 32 <= len; j += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&s[j]);
+		__m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, low), v),
+				_mm256_cmpeq_epi8(v, del));
+		unsigned int mask = _mm256_movemask_epi8(hit);
+		if (mask)
+			return j + __builtin_ctz(mask);
+	}
+	for (; j < len; j++)
+		if ((unsigned char)s[j] < 32 || s[j] == 127)
+			return j;
+	return len;
+}
+
+static int sse2FindCntrl(const char *s, int len) {
+	__m128i low = _mm_set1_epi8(31);
+	__m128i del = _mm_set1_epi8(127);
+	int j = 0;
+	for (; j + 16 <= len; j += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, low), v),
+				_mm_cmpeq_epi8(v, del));
+		unsigned int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return j + __builtin_ctz(mask);
+	}
+	for (; j < len; j++)
+		if ((unsigned char)s[j] < 32 || s[j] == 127)
+			return j;
+	return len;
+}
+
+__attribute__((target("avx2")))
+static int avx2HlRun(const unsigned char *hl, int len) {
+	__m256i first = _mm256_set1_epi8(hl[0]);
+	int j = 0;
+	for (; j + 32 <= len; j += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&hl[j]);
+		unsigned int mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first));
+		if (mask)
+			return j + __builtin_ctz(mask);
+	}
+	while (j < len && hl[j] == hl[0])
+		j++;
+	return j;
+}
+
+static int sse2HlRun(const unsigned char *hl, int len) {
+	__m128i first = _mm_set1_epi8(hl[0]);
+	int j = 0;
+	for (; j + 16 <= len; j += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&hl[j]);
+		unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) & 0xffff;
+		if (mask)
+			return j + __builtin_ctz(mask);
+	}
+	while (j < len && hl[j] == hl[0])
+		j++;
+	return j;
+}
+
+/* Substring search: positions whose first and last bytes both match the
+ * needle are found a vector at a time and only those are compared in
+ * full. The needle is at least two bytes long. */
+__attribute__((target("avx2")))
+static const char *avx2Find(const char *s, int n, const char *p, int m) {
+	__m256i first = _mm256_set1_epi8(p[0]);
+	__m256i last = _mm256_set1_epi8(p[m - 1]);
+	int i = 0;
+	for (; i + m - 1 + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)&s[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&s[i + m - 1]);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+					_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int k = i + __builtin_ctz(mask);
+			if (memcmp(&s[k + 1], &p[1], m - 2) == 0)
+				return &s[k];
+		}
+	}
+	return memmem(&s[i], n - i, p, m);
+}
+
+static const char *sse2Find(const char *s, int n, const char *p, int m) {
+	__m128i first = _mm_set1_epi8(p[0]);
+	__m128i last = _mm_set1_epi8(p[m - 1]);
+	int i = 0;
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&s[i + m - 1]);
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int k = i + __builtin_ctz(mask);
+			if (memcmp(&s[k + 1], &p[1], m - 2) == 0)
+				return &s[k];
+		}
+	}
+	return memmem(&s[i], n - i, p, m);
+}
+#endif
+
+void editorInitKernels() {
+#ifdef KILO_SIMD
+	__builtin_cpu_init();
+	simd_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/* Number of occurrences of `c` in s[0..len). */
+int editorCountByte(const char *s, int len, char c) {
+#ifdef KILO_SIMD
+	return simd_avx2 ? avx2CountByte(s, len, c) : sse2CountByte(s, len, c);
+#else
+	int n = 0;
+	for (int j = 0; j < len; j++)
+		n += s[j] == c;
+	return n;
+#endif
+}
+
+/* Index of the first control character in s[0..len), or len. */
+int editorFindCntrl(const char *s, int len) {
+#ifdef KILO_SIMD
+	return simd_avx2 ? avx2FindCntrl(s, len) : sse2FindCntrl(s, len);
+#else
+	for (int j = 0; j < len; j++)
+		if ((unsigned char)s[j] < 32 || s[j] == 127)
+			return j;
+	return len;
+#endif
+}
+
+/* Length of the run of bytes equal to hl[0]; len must be at least 1. */
+int editorHlRun(const unsigned char *hl, int len) {
+#ifdef KILO_SIMD
+	return simd_avx2 ? avx2HlRun(hl, len) : sse2HlRun(hl, len);
+#else
+	int j = 1;
+	while (j < len && hl[j] == hl[0])
+		j++;
+	return j;
+#endif
+}
+
+/* First occurrence of p[0..m) in s[0..n), or NULL. */
+const char *editorFindBytes(const char *s, int n, const char *p, int m) {
+	if (m == 0)
+		return s;
+	if (m == 1)
+		return memchr(s, p[0], n);
+	if (m > n)
+		return NULL;
+#ifdef KILO_SIMD
+	return simd_avx2 ? avx2Find(s, n, p, m) : sse2Find(s, n, p, m);
+#else
+	return memmem(s, n, p, m);
+#endif
+}
+
+/* row operations */
+int editorRowCxToRx(erow *row, int cx) {
+	if (row->render == row->chars)
+		return cx;
+	int rx = 0;
+	int j;
+	for (j = 0; j < cx; j++) {
+		if (row->chars[j] == '\t')
+			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+		rx++;
+	}
+	return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+	if (row->render == row->chars)
+		return rx < 0 ? 0 : rx < row->size ? rx : row->size;
+	int cur_rx = 0;
+	int old_rx;
+	int cx;
+	for (cx = 0; cx < row->size; cx++) {
+		old_rx = cur_rx;
+		if (row->chars[cx] == '\t')
+			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+		cur_rx++;
+
+		if (cur_rx > rx) {
+			if (rx - old_rx > cur_rx - rx)
+				return cx + 1;
+			return cx;
+		}
+	}
+	return cx;
+}
+
+/* Rows without tabs render as themselves: render then simply aliases chars. */
+void editorUpdateRender(erow *row) {
+	int tabs = editorCountByte(row->chars, row->size, '\t');
+
+	if (tabs == 0) {
+		if (row->render != row->chars)
+			storeFree(row->render, row->rcap);
+		row->render = row->chars;
+		row->rcap = 0;
+		row->rsize = row->size;
+		return;
+	}
+
+	if (row->render == row->chars)
+		row->render = NULL;
+	row->render = storeResize(row->render, &row->rcap, row->size + (KILO_TAB_STOP - 1) * tabs + 1);
+
+	/* copy the spans between tabs whole */
+	int idx = 0;
+	char *p = row->chars;
+	char *end = row->chars + row->size;
+	while (p < end) {
+		char *tab = memchr(p, '\t', end - p);
+		int span = (tab ? tab : end) - p;
+		memcpy(&row->render[idx], p, span);
+		idx += span;
+		if (tab == NULL)
+			break;
+		int pad = KILO_TAB_STOP - idx % KILO_TAB_STOP;
+		memset(&row->render[idx], ' ', pad);
+		idx += pad;
+		p = tab + 1;
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+}
+
+void editorUpdateRow(erow *row) {
+	row->version = ++E.version;
+	editorUpdateRender(row);
+	editorUpdateSyntax(row);
+}
+
+/* Builds render and hl for rows loaded lazily; called before a row is shown.
+ * A row whose comment state is already known is lexed in that state. */
+erow *editorRowRender(erow *row) {
+	if (row->render != NULL)
+		return row;
+	editorUpdateRender(row);
+	if (row->hl_valid) {
+		editorSyntaxLexRow(row, row->hl_in);
+	} else {
+		unsigned char *hl = editorHlScratch(row->rsize + 1);
+		memset(hl, HL_NORMAL, row->rsize);
+		editorRowSetHl(row, hl);
+	}
+	return row;
+}
+
+/* Gives a row its own writable copy of chars before an edit: rows loaded
+ * from the file mapping, and rows a background save is still writing,
+ * are copied first. */
+void editorRowUnmap(erow *row) {
+	bool saving = editorSaveHolds(row);
+	if (!row->mapped && !saving)
+		return;
+	char *old = row->chars;
+	unsigned char oldcap = row->ccap;
+	char *chars = storeAlloc(row->size + 1, &row->ccap);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	if (row->render == row->chars)
+		row->render = chars;
+	row->chars = chars;
+	row->mapped = false;
+	if (saving) {
+		editorSaveDefer(old, oldcap);
+		row->version = ++E.version;
+	}
+}
+
+/* Makes chars writable and large enough for `size` bytes plus the
+ * terminator, keeping a shared render pointed at it. */
+void editorRowReserve(erow *row, int size) {
+	editorRowUnmap(row);
+	bool shared = row->render == row->chars;
+	row->chars = storeResize(row->chars, &row->ccap, size + 1);
+	if (shared)
+		row->render = row->chars;
+}
+
+/* Updates render and hl after chars[at, at + inserted) replaced `removed`
+ * bytes. For rows without tabs render is chars already, so only hl is
+ * patched: the old highlighting after the edit is shifted into place and
+ * lexing restarts at the last plain separator before the edit, stopping
+ * once it agrees with the old highlighting again. Other rows are rebuilt. */
+void editorRowPatch(erow *row, int at, int removed, int inserted) {
+	static unsigned char *old = NULL;
+	static int old_size = 0;
+
+	/* a full update also clears selection and match marks */
+	unsigned char *hl = row->hl_valid ? editorRowHl(row) : NULL;
+	if (row->render != row->chars || hl == NULL ||
+			memchr(&row->chars[at], '\t', inserted) ||
+			memchr(hl, HL_MATCH, row->rsize)) {
+		editorUpdateRow(row);
+		return;
+	}
+	row->version = ++E.version;
+
+	int tail = row->rsize - (at + removed);
+	if (tail >= old_size) {
+		old_size = tail * 2 + 64;
+		old = realloc(old, old_size);
+	}
+	memcpy(old, &hl[at + removed], tail);
+
+	row->rsize = row->size;
+	hl = editorHlScratch(row->rsize + 1);
+
+	/* back off far enough that no comment delimiter straddles the edit */
+	struct editorSyntax *s = E.syntax;
+	int from = at;
+	if (s)
+		from -= (s->scs_len > s->mcs_len ? s->scs_len : s->mcs_len) - 1;
+	if (from > at)
+		from = at;
+	while (s && from > 0 && !(hl[from - 1] == HL_NORMAL &&
+				(s->cclass[(unsigned char)row->render[from - 1]] & CC_SEP)))
+		from--;
+	if (from < 0)
+		from = 0;
+
+	int open_comment = editorSyntaxLexRange(s, row->render, row->rsize, hl,
+			from, from == 0 ? row->hl_in : 0, old, at + inserted);
+	editorRowSetHl(row, hl);
+	if (open_comment != -1 && open_comment != row->hl_open_comment) {
+		row->hl_open_comment = open_comment;
+		editorSyntaxInvalidate(editorRowIndex(row) + 1);
+	}
+}
+
+/* Frees render and hl of a row whose text was replaced, leaving them to be
+ * rebuilt when the row is drawn or highlighted, as for a freshly loaded row. */
+void editorRowInvalidate(erow *row) {
+	if (row->render != row->chars)
+		storeFree(row->render, row->rcap);
+	storeFree(row->hl, row->hlcap);
+	row->render = NULL;
+	row->rsize = 0;
+	row->rcap = 0;
+	row->hl = NULL;
+	row->hlcap = 0;
+	row->hl_valid = false;
+	row->version = ++E.version;
+}
+
+/* Inserts a row without rendering or highlighting it, for bulk edits; the
+ * caller invalidates syntax from the first such row. */
+erow *editorInsertRowLazy(int at, const char *s, int len) {
+	editorUndoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+	erow *row = ropeInsert(at);
+	E.numrows++;
+	row->size = len;
+	row->chars = storeAlloc(len + 1, &row->ccap);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->rcap = 0;
+	row->hlcap = 0;
+	row->hl_open_comment = 0;
+	row->hl_in = 0;
+	row->hl_valid = false;
+	row->mapped = false;
+	row->version = ++E.version;
+	return row;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+	if (at < 0 || at > E.numrows) return;
+
+	editorUndoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+	erow *row = ropeInsert(at);
+	E.numrows++;
+
+	row->size = len;
+	row->chars = storeAlloc(len + 1, &row->ccap);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->rcap = 0;
+	row->hlcap = 0;
+	row->hl_open_comment = 0;
+	row->hl_in = 0;
+	row->hl_valid = false;
+	row->mapped = false;
+	row->version = 0;
+
+	editorUpdateRow(row);
+	E.dirty++;
+}	
+
+void editorFreeRow(erow *row) {
+	if (row->render != row->chars)
+		storeFree(row->render, row->rcap);
+	if (editorSaveHolds(row))
+		editorSaveDefer(row->chars, row->ccap);
+	else if (!row->mapped)
+		storeFree(row->chars, row->ccap);
+	storeFree(row->hl, row->hlcap);
+}
+
+void editorDelRow(int at) {
+	if (at < 0 || at >= E.numrows)
+		return;
+	erow *row = editorRowAt(at);
+	editorUndoRecord(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+	editorFreeRow(row);
+	ropeDelete(at);
+	E.numrows--;
+	editorSyntaxInvalidate(at);
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+	if (at < 0 || at > row->size)
+		at = row->size;
+	char ch = c;
+	editorUndoRecord(UNDO_INSERT, editorRowIndex(row), at, &ch, 1);
+	editorRowReserve(row, row->size + 1);
+	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+	row->size++;
+	row->chars[at] = c;
+	editorRowPatch(row, at, 0, 1);
+	E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+	int at = row->size;
+	editorUndoRecord(UNDO_INSERT, editorRowIndex(row), at, s, len);
+	editorRowReserve(row, row->size + len);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	row->chars[row->size] = '\0';
+	editorRowPatch(row, at, 0, len);
+	E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+	if (at < 0 || at >= row->size)
+		return;
+	editorUndoRecord(UNDO_DELETE, editorRowIndex(row), at, &row->chars[at], 1);
+	editorRowUnmap(row);
+	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+	row->size--;
+	editorRowPatch(row, at, 1, 0);
+	E.dirty++;
+}
+
+void editorRowDelChars(erow *row, int at, int until) {
+	if (at < 0 || at >= row->size)
+		return;
+	editorUndoRecord(UNDO_DELETE, editorRowIndex(row), until, &row->chars[until], at + 1 - until);
+	editorRowUnmap(row);
+	memmove(&row->chars[until], &row->chars[at + 1], row->size - at);
+	row->size -= at + 1 - until;
+	editorRowPatch(row, until, at + 1 - until, 0);
+	E.dirty++;
+}
+
+/* editor operations */
+void editorInsertChar(int c) {
+	if (E.cy == E.numrows)
+		editorInsertRow(E.numrows, "", 0);
+	editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+	E.cx++;
+}
+
+/* Inserts text at the cursor as one edit; \r, \n and \r\n end lines. The
+ * lines after the first become rows directly, highlighted when drawn or by
+ * the background highlighter, instead of being typed in one by one. */
+void editorInsertText(const char *s, size_t len) {
+	if (len == 0)
+		return;
+	if (E.cy == E.numrows)
+		editorInsertRow(E.numrows, "", 0);
+	erow *row = editorRowAt(E.cy);
+	int at = E.cx;
+
+	const char *end = s + len;
+	const char *eol = s;
+	while (eol < end && *eol != '\r' && *eol != '\n')
+		eol++;
+	int first = eol - s;
+
+	/* the text after the cursor moves to the last line */
+	int taillen = row->size - at;
+	char *tail = malloc(taillen + 1);
+	if (tail == NULL)
+		die("malloc");
+	memcpy(tail, &row->chars[at], taillen);
+	if (eol == end) {
+		editorUndoRecord(UNDO_INSERT, E.cy, at, s, first);
+		editorRowReserve(row, row->size + first);
+		memmove(&row->chars[at + first], &row->chars[at], taillen + 1);
+		memcpy(&row->chars[at], s, first);
+		row->size += first;
+		editorRowPatch(row, at, 0, first);
+		E.cx += first;
+		E.dirty++;
+		free(tail);
+		return;
+	}
+	editorUndoRecord(UNDO_DELETE, E.cy, at, tail, taillen);
+	editorUndoRecord(UNDO_INSERT, E.cy, at, s, first);
+	editorRowReserve(row, at + first);
+	memcpy(&row->chars[at], s, first);
+	row->size = at + first;
+	row->chars[row->size] = '\0';
+	editorRowPatch(row, at, taillen, first);
+
+	int y = E.cy;
+	const char *p = eol;
+	while (p < end) {
+		p += (p[0] == '\r' && p + 1 < end && p[1] == '\n') ? 2 : 1;
+		eol = p;
+		while (eol < end && *eol != '\r' && *eol != '\n')
+			eol++;
+		int n = eol - p;
+
+		y++;
+		if (eol < end) {
+			editorInsertRowLazy(y, p, n);
+		} else {
+			char *joined = malloc(n + taillen + 1);
+			if (joined == NULL)
+				die("malloc");
+			memcpy(joined, p, n);
+			memcpy(&joined[n], tail, taillen);
+			editorInsertRowLazy(y, joined, n + taillen);
+			free(joined);
+			E.cx = n;
+		}
+		p = eol;
+	}
+	free(tail);
+
+	editorSyntaxInvalidate(E.cy + 1);
+	E.cy = y;
+	E.dirty++;
+}
+
+void editorInsertNewline() {
+	int il = 0; // indentation level to smart-indent
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		erow *row = editorRowAt(E.cy);
+
+		/* smart-indent */
+		char indented[row->size];
+		for (il = 0; il < E.cx && (row->chars[il] == '\t' || row->chars[il] == ' '); il++)
+			indented[il] = row->chars[il];
+		memcpy(&indented[il], &row->chars[E.cx], row->size - E.cx);
+
+		editorInsertRow(E.cy + 1, indented, il + row->size - E.cx);
+		row = editorRowAt(E.cy);
+		int removed = row->size - E.cx;
+		editorUndoRecord(UNDO_DELETE, E.cy, E.cx, &row->chars[E.cx], removed);
+		editorRowUnmap(row);
+		row->size = E.cx;
+		row->chars[row->size] = '\0';
+		editorRowPatch(row, E.cx, removed, 0);
+	}
+	E.cy++;
+	E.cx = 0;
+	for (int j = 0; j < il; j++)
+		editorMoveCursor(ARROW_RIGHT);
+}
+
+void editorDelChar() {
+	if (E.cy == E.numrows)
+		return;
+	if (E.cx == 0 && E.cy == 0)
+		return;
+	erow *row = editorRowAt(E.cy);
+	if (E.cx > 0) {
+		editorRowDelChar(row, E.cx - 1);
+		E.cx--;
+	} else {
+		E.cx = editorRowAt(E.cy - 1)->size;
+		editorRowAppendString(editorRowAt(E.cy - 1), row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/* undo */
+/* Edits are logged as they reach the row primitives. Records are packed back
+ * to back in one growing arena, each followed by its size so the log can
+ * be walked both ways; consecutive typed or deleted characters extend the
+ * record before them. An undo step is the run of records from one marked
+ * `group` to the next. Once the log outgrows its limit the oldest steps
+ * are dropped. */
+struct undoOp {
+	int size; // of the whole record, trailing size included
+	unsigned char type;
+	bool group; // first edit of an undo step
+	int row, col;
+	int cx, cy; // cursor before the step, kept by its first edit
+	int len;
+	char text[];
+};
+
+struct undoLog {
+	char *arena;
+	size_t start, pos, end, cap; // records [start, end); those from pos on can be redone
+	size_t limit;
+	bool boundary; // the next edit starts a new step
+	int cx, cy; // cursor when the step was broken
+	bool suspended; // edits are not recorded: replaying, or loading a file
+	bool dropped; // the current step outgrew the limit and is not recorded
+};
+
+struct undoLog undo;
+
+int undoOpSize(int len) {
+	return (sizeof(struct undoOp) + len + sizeof(int) + 3) & ~3;
+}
+
+struct undoOp *undoAt(size_t offset) {
+	return (struct undoOp *)&undo.arena[offset];
+}
+
+/* The record ending at offset. */
+struct undoOp *undoBefore(size_t offset) {
+	int size;
+	memcpy(&size, &undo.arena[offset - sizeof(int)], sizeof(int));
+	return undoAt(offset - size);
+}
+
+/* Sizes the record at offset, the last one, for len bytes of text. */
+struct undoOp *undoPlace(size_t offset, int len) {
+	size_t need = offset + undoOpSize(len);
+	if (need > undo.cap) {
+		undo.cap = undo.cap ? undo.cap : 1 << 16;
+		while (undo.cap < need)
+			undo.cap *= 2;
+		undo.arena = realloc(undo.arena, undo.cap);
+		if (undo.arena == NULL)
+			die("realloc");
+	}
+	struct undoOp *op = undoAt(offset);
+	op->size = undoOpSize(len);
+	op->len = len;
+	memcpy(&undo.arena[offset + op->size - sizeof(int)], &op->size, sizeof(int));
+	undo.end = undo.pos = offset + op->size;
+	return op;
+}
+
+/* Drops the oldest steps until the log fits its limit. */
+void undoTrim() {
+	while (undo.end - undo.start > undo.limit) {
+		size_t next = undo.start + undoAt(undo.start)->size;
+		while (next < undo.end && !undoAt(next)->group)
+			next += undoAt(next)->size;
+		if (next == undo.end) {
+			/* only the current step is left, and part of it is lost */
+			undo.start = undo.pos = undo.end = 0;
+			undo.dropped = true;
+			return;
+		}
+		undo.start = next;
+	}
+	if (undo.start > undo.cap / 2) {
+		memmove(undo.arena, &undo.arena[undo.start], undo.end - undo.start);
+		undo.pos -= undo.start;
+		undo.end -= undo.start;
+		undo.start = 0;
+	}
+}
+
+/* Ends the current undo step; the next edit starts another, which undoes
+ * back to the cursor as it is now. */
+void editorUndoBreak() {
+	undo.boundary = true;
+	undo.cx = E.cx;
+	undo.cy = E.cy;
+}
+
+/* Logs an edit of one of the undo types, before it is made. For deletions
+ * text is what goes away. */
+void editorUndoRecord(int type, int row, int col, const char *text, int len) {
+	if (undo.suspended)
+		return;
+	bool group = undo.boundary || undo.pos == undo.start;
+	if (undo.boundary)
+		undo.dropped = false;
+	undo.boundary = false;
+	if (undo.dropped)
+		return;
+	/* a new edit ends what could be redone */
+	undo.end = undo.pos;
+
+	if (!group) {
+		struct undoOp *last = undoBefore(undo.pos);
+		if (type == last->type && row == last->row) {
+			int n = last->len;
+			if (type == UNDO_INSERT && col == last->col + n) {
+				last = undoPlace(undo.pos - last->size, n + len);
+				memcpy(&last->text[n], text, len);
+				undoTrim();
+				return;
+			}
+			if (type == UNDO_DELETE && col == last->col) {
+				last = undoPlace(undo.pos - last->size, n + len);
+				memcpy(&last->text[n], text, len);
+				undoTrim();
+				return;
+			}
+			if (type == UNDO_DELETE && col + len == last->col) {
+				last = undoPlace(undo.pos - last->size, n + len);
+				memmove(&last->text[len], last->text, n);
+				memcpy(last->text, text, len);
+				last->col = col;
+				undoTrim();
+				return;
+			}
+		}
+	}
+
+	struct undoOp *op = undoPlace(undo.pos, len);
+	op->type = type;
+	op->group = group;
+	op->row = row;
+	op->col = col;
+	op->cx = undo.cx;
+	op->cy = undo.cy;
+	memcpy(op->text, text, len);
+	undoTrim();
+}
+
+/* Applies an edit of the log, or its inverse when undoing. Rows edited in
+ * place are left to be re-rendered and re-lexed lazily, so a step of any
+ * size is replayed in one pass. */
+void editorUndoApply(struct undoOp *op, bool inverse) {
+	int type = op->type;
+	if (inverse)
+		type = type == UNDO_INSERT ? UNDO_DELETE : type == UNDO_DELETE ? UNDO_INSERT :
+			type == UNDO_INSERT_ROW ? UNDO_DELETE_ROW : UNDO_INSERT_ROW;
+	erow *row;
+	switch (type) {
+		case UNDO_INSERT:
+			row = editorRowAt(op->row);
+			editorRowReserve(row, row->size + op->len);
+			memmove(&row->chars[op->col + op->len], &row->chars[op->col], row->size - op->col + 1);
+			memcpy(&row->chars[op->col], op->text, op->len);
+			row->size += op->len;
+			editorRowInvalidate(row);
+			break;
+		case UNDO_DELETE:
+			row = editorRowAt(op->row);
+			editorRowUnmap(row);
+			memmove(&row->chars[op->col], &row->chars[op->col + op->len],
+					row->size - op->col - op->len + 1);
+			row->size -= op->len;
+			editorRowInvalidate(row);
+			break;
+		case UNDO_INSERT_ROW:
+			editorInsertRowLazy(op->row, op->text, op->len);
+			break;
+		case UNDO_DELETE_ROW:
+			editorDelRow(op->row);
+			break;
+	}
+}
+
+/* Replays the edits of [from, to) forwards, or backwards when undoing. */
+void editorUndoReplay(size_t from, size_t to, bool inverse) {
+	undo.suspended = true;
+	int top = E.numrows;
+	struct undoOp *op = NULL;
+	for (size_t at = inverse ? to : from; inverse ? at > from : at < to; ) {
+		if (inverse) {
+			op = undoBefore(at);
+			at -= op->size;
+		} else {
+			op = undoAt(at);
+			at += op->size;
+		}
+		editorUndoApply(op, inverse);
+		if (op->row < top)
+			top = op->row;
+	}
+	undo.suspended = false;
+	undo.boundary = true;
+	editorSyntaxInvalidate(top);
+	E.dirty++;
+}
+
+/* Puts the cursor at (cx, cy), kept inside the buffer. */
+void undoMoveCursor(int cx, int cy) {
+	E.cy = cy < E.numrows ? cy : E.numrows;
+	int size = E.cy < E.numrows ? editorRowAt(E.cy)->size : 0;
+	E.cx = cx < size ? cx : size;
+}
+
+/* Reverts the last step; false if there is none. */
+bool editorUndo() {
+	if (undo.pos == undo.start)
+		return false;
+	size_t to = undo.pos;
+	struct undoOp *op;
+	do {
+		op = undoBefore(undo.pos);
+		undo.pos -= op->size;
+	} while (!op->group);
+	int cx = op->cx, cy = op->cy;
+	editorUndoReplay(undo.pos, to, true);
+	undoMoveCursor(cx, cy);
+	return true;
+}
+
+/* Makes the step undone last again; false if there is none. */
+bool editorRedo() {
+	if (undo.pos == undo.end)
+		return false;
+	size_t from = undo.pos;
+	do
+		undo.pos += undoAt(undo.pos)->size;
+	while (undo.pos < undo.end && !undoAt(undo.pos)->group);
+	editorUndoReplay(from, undo.pos, false);
+	/* the cursor goes to the end of the last edit */
+	struct undoOp *op = undoBefore(undo.pos);
+	undoMoveCursor(op->type == UNDO_INSERT ? op->col + op->len :
+			op->type == UNDO_DELETE ? op->col : 0, op->row);
+	return true;
+}
+
+/* Empties the log, as when another file is loaded. */
+void editorUndoReset() {
+	undo.start = undo.pos = undo.end = 0;
+	editorUndoBreak();
+	undo.dropped = false;
+}
+
+/* file io */
+/* Writes iov[0..n) completely, resuming after short writes. */
+int writevAll(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+/* A save running on its own thread. It writes the rows as they were when
+ * it started: the snapshot points straight at the row buffers, which stay
+ * untouched until it finishes because edits copy them first (see
+ * editorRowUnmap()) and deleted rows hand theirs to `garbage`. */
+struct saveJob {
+	struct iovec *iov;
+	int n, cap;
+	long long total;      // bytes in the snapshot
+	unsigned int version; // E.version when the snapshot was taken
+	int dirty;            // E.dirty at that time
+	char *target;
+	mode_t mode;
+	uid_t uid; // of the file replaced, or -1 for a new one
+	gid_t gid;
+	struct timespec shown; // last progress update
+	struct {
+		char *chars;
+		unsigned char cap;
+	} *garbage;
+	int ngarbage, garbagecap;
+};
+
+/* Rows whose chars are part of the snapshot of a running save. */
+bool editorSaveHolds(erow *row) {
+	return E.save && !row->mapped && row->version <= E.save->version;
+}
+
+/* Frees row storage once the running save is done with it. */
+void editorSaveDefer(char *chars, unsigned char cap) {
+	struct saveJob *job = E.save;
+	if (job->ngarbage == job->garbagecap) {
+		job->garbagecap = job->garbagecap ? job->garbagecap * 2 : 64;
+		job->garbage = realloc(job->garbage, sizeof(*job->garbage) * job->garbagecap);
+		if (job->garbage == NULL)
+			die("realloc");
+	}
+	job->garbage[job->ngarbage].chars = chars;
+	job->garbage[job->ngarbage].cap = cap;
+	job->ngarbage++;
+}
+
+void saveJobAppend(struct saveJob *job, char *p, size_t len) {
+	if (job->n == job->cap) {
+		job->cap = job->cap ? job->cap * 2 : 1024;
+		job->iov = realloc(job->iov, sizeof(struct iovec) * job->cap);
+		if (job->iov == NULL)
+			die("realloc");
+	}
+	job->iov[job->n++] = (struct iovec){p, len};
+}
+
+/* Records every row and its newline as buffers to write. Unedited rows
+ * that still sit in the file mapping are merged with their neighbours, so
+ * an untouched region of the file is a single buffer. */
+void editorSnapshotRows(struct saveJob *job) {
+	for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) {
+		job->total += row->size + 1;
+		char *end = row->chars + row->size;
+		if (row->mapped && end < E.map + E.mapsize && *end == '\n') {
+			struct iovec *last = job->n ? &job->iov[job->n - 1] : NULL;
+			if (last && (char *)last->iov_base + last->iov_len == row->chars)
+				last->iov_len += row->size + 1;
+			else
+				saveJobAppend(job, row->chars, row->size + 1);
+			continue;
+		}
+		if (row->size)
+			saveJobAppend(job, row->chars, row->size);
+		saveJobAppend(job, "\n", 1);
+	}
+	job->version = E.version;
+	job->dirty = E.dirty;
+}
+
+/* Shows how far the save got, at most ten times a second and only while
+ * the main thread is waiting for input. */
+void editorSaveProgress(struct saveJob *job, long long written) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - job->shown.tv_sec) * 1000 + (now.tv_nsec - job->shown.tv_nsec) / 1000000 < 100)
+		return;
+	job->shown = now;
+	if (atomic_load(&E.lock_wanted) || pthread_mutex_trylock(&E.lock) != 0)
+		return;
+	if (!E.prompting) {
+		editorSetStatusMessage("Saving %s... %d%%", E.filename,
+				(int)(written * 100 / (job->total ? job->total : 1)));
+		editorRefreshScreen();
+	}
+	pthread_mutex_unlock(&E.lock);
+}
+
+/* Writes the snapshot to a temporary file next to the target, makes it
+ * durable and renames it into place, so the old file stays intact until
+ * the new one is on disk. The new file takes the owner, group and mode of
+ * the old one as far as we may set them; being a new inode, it is not
+ * shared with other hard links to the old one. Returns the bytes written,
+ * or -1 with errno. */
+long long editorSaveWrite(struct saveJob *job) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.kilo-XXXXXX", job->target);
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &job->shown);
+
+	/* only root may give a file away; others can still keep its group */
+	if (job->uid != (uid_t)-1 && fchown(fd, job->uid, job->gid) == -1 && errno == EPERM)
+		fchown(fd, (uid_t)-1, job->gid);
+	bool ok = fchmod(fd, job->mode) == 0;
+	long long written = 0;
+	for (int i = 0; ok && i < job->n; i += IOV_MAX) {
+		int n = job->n - i < IOV_MAX ? job->n - i : IOV_MAX;
+		for (int j = i; j < i + n; j++)
+			written += job->iov[j].iov_len;
+		ok = writevAll(fd, &job->iov[i], n) == 0;
+		editorSaveProgress(job, written);
+	}
+	ok = ok && fsync(fd) == 0;
+	if (close(fd) == -1)
+		ok = false;
+	if (ok && rename(tmp, job->target) == -1)
+		ok = false;
+	if (!ok) {
+		int saved = errno;
+		unlink(tmp);
+		errno = saved;
+		return -1;
+	}
+
+	/* make the rename itself durable */
+	char *slash = strrchr(job->target, '/');
+	if (slash)
+		*slash = '\0';
+	int dirfd = open(slash ? (slash == job->target ? "/" : job->target) : ".", O_RDONLY | O_DIRECTORY);
+	if (dirfd != -1) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+	return job->total;
+}
+
+void *editorSaveWorker(void *arg) {
+	struct saveJob *job = arg;
+	long long len = editorSaveWrite(job);
+	int err = errno;
+
+	editorLock();
+	/* edits made while saving are still unsaved */
+	if (len != -1)
+		E.dirty -= job->dirty;
+	if (!E.prompting) {
+		if (len != -1)
+			editorSetStatusMessage("%lld bytes written to disk", len);
+		else
+			editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+	}
+	for (int i = 0; i < job->ngarbage; i++)
+		storeFree(job->garbage[i].chars, job->garbage[i].cap);
+	free(job->garbage);
+	free(job->iov);
+	free(job->target);
+	free(job);
+	E.save = NULL;
+	pthread_cond_broadcast(&E.save_done);
+	if (!E.prompting)
+		editorRefreshScreen();
+	editorUnlock();
+	return NULL;
+}
+
+/* Indexes the lines of a regular file mapped read-only into memory. Rows
+ * point into the mapping and get render/hl only once they are drawn, so
+ * opening costs one memchr pass and no per-line allocation. */
+bool editorOpenMapped(char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		die("open");
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	E.map = map;
+	E.mapsize = st.st_size;
+	madvise(map, E.mapsize, MADV_SEQUENTIAL);
+
+	/* drop scanned pages from our resident set as we go */
+	const size_t chunk = 64 << 20;
+	char *p = map, *end = map + E.mapsize, *released = map;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		int len = eol - p;
+		while (len > 0 && p[len - 1] == '\r')
+			len--;
+
+		erow *row = ropeInsert(E.numrows);
+		E.numrows++;
+		row->size = len;
+		row->chars = p;
+		row->mapped = true;
+		row->rsize = 0;
+		row->render = NULL;
+		row->hl = NULL;
+		row->ccap = 0;
+		row->rcap = 0;
+		row->hlcap = 0;
+		row->hl_open_comment = 0;
+		row->hl_in = 0;
+		row->hl_valid = false;
+		row->version = 0;
+
+		p = nl ? nl + 1 : end;
+		if ((size_t)(p - released) >= chunk) {
+			madvise(released, chunk, MADV_DONTNEED);
+			released += chunk;
+		}
+	}
+	madvise(map, E.mapsize, MADV_NORMAL);
+	return true;
+}
+
+/* Empties the buffer; row storage is released wholesale, not row by row. */
+void editorCloseFile() {
+	editorSearchReset();
+	ropeFreeNode(E.rope);
+	storeReset();
+	E.rope = ropeNewNode(true);
+	E.numrows = 0;
+	if (E.map) {
+		munmap(E.map, E.mapsize);
+		E.map = NULL;
+		E.mapsize = 0;
+	}
+	E.cx = E.cy = E.rx = 0;
+	E.rowoff = E.coloff = 0;
+	E.hl_checked = 0;
+	E.dirty = 0;
+	editorUndoReset();
+}
+
+void editorOpen(char *filename) {
+	editorCloseFile();
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	editorSelectSyntaxHighlight();
+
+	if (editorOpenMapped(filename)) {
+		E.dirty = 0;
+		return;
 	}
-	for (; j < E.numrows - 1; j++)
-		E.row[j].idx--;
-	E.numrows--;
-	E.dirty++;
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp) die("fopen");
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	undo.suspended = true;
+	while ((linelen = getline(&line, &linecap, fp)) != -1) {
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+			linelen--;
+		editorInsertRow(E.numrows, line, linelen);
+	}
+	undo.suspended = false;
+	free(line);
+	fclose(fp);
+	E.dirty = 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size)
-		at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+void editorSave() {
+	if (E.save) {
+		editorSetStatusMessage("Already saving %s", E.filename);
+		return;
+	}
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s", NULL, false);
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	struct saveJob *job = calloc(1, sizeof(struct saveJob));
+	if (job == NULL)
+		die("calloc");
+	/* write next to the real target so the rename stays on its filesystem */
+	job->target = realpath(E.filename, NULL);
+	if (job->target == NULL)
+		job->target = strdup(E.filename);
+	struct stat st;
+	if (stat(job->target, &st) == 0) {
+		job->mode = st.st_mode & 07777;
+		job->uid = st.st_uid;
+		job->gid = st.st_gid;
+	} else {
+		job->uid = (uid_t)-1;
+		job->gid = (gid_t)-1;
+		job->mode = umask(0);
+		umask(job->mode);
+		job->mode = 0666 & ~job->mode;
+	}
+	editorSnapshotRows(job);
+
+	/* SIGWINCH must be handled by the main thread */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	E.save = job;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, editorSaveWorker, job) != 0) {
+		E.save = NULL;
+		free(job->iov);
+		free(job->target);
+		free(job);
+		editorSetStatusMessage("Can't save! %s", strerror(errno));
+	} else {
+		pthread_detach(thread);
+		editorSetStatusMessage("Saving %s...", E.filename);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+/* Blocks until a running save has finished. */
+void editorWaitForSave() {
+	if (E.save == NULL)
+		return;
+	editorSetStatusMessage("Waiting for %s to be saved...", E.filename);
+	editorRefreshScreen();
+	while (E.save)
+		pthread_cond_wait(&E.save_done, &E.lock);
 }
 
-void editorRowDelChar(erow *row, int at) {
-	if (at < 0 || at >= row->size)
+/* thread pool */
+/* Worker threads for jobs that split into independent slices. Only the
+ * main thread submits work, and poolRun() returns once every slice ran. */
+#define KILO_POOL_THREADS 16
+
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	int nthreads; // including the thread calling poolRun()
+	unsigned int generation;
+	int next, pending;
+	void (*fn)(int slice, int nslices, void *arg);
+	void *arg;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+void *poolWorker(void *arg) {
+	(void)arg;
+	unsigned int seen = 0;
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (pool.generation == seen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		seen = pool.generation;
+		int slice = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(slice, pool.nthreads, pool.arg);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	return NULL;
+}
+
+void poolStart() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool.nthreads = cpus < 1 ? 1 : cpus > KILO_POOL_THREADS ? KILO_POOL_THREADS : cpus;
+
+	/* SIGWINCH must be handled by the main thread */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (int i = 1; i < pool.nthreads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, poolWorker, NULL) != 0) {
+			pool.nthreads = i;
+			break;
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Runs fn(slice, nslices, arg) for every slice, one per thread; small
+ * jobs pass parallel = false and run as a single slice. */
+void poolRun(void (*fn)(int, int, void *), void *arg, bool parallel) {
+	if (pool.nthreads == 0)
+		poolStart();
+	if (!parallel || pool.nthreads == 1) {
+		fn(0, 1, arg);
 		return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.next = 1;
+	pool.pending = pool.nthreads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	fn(0, pool.nthreads, arg);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* regex */
+/* Extended regular expressions (. [] [^] * + ? {m,n} | () ^ $ and the
+ * \d \w \s classes) compiled to a Thompson NFA and run as DFAs whose
+ * states are built lazily on first use. Matches are leftmost-longest: a
+ * backwards pass over the row marks where matches start, and an anchored
+ * forward pass from a start finds where its match ends. A forward pass
+ * runs until no match can grow, which for patterns like a|a.*b is the end
+ * of the row, so the passes of one row share a budget of bytes; once it
+ * is spent, each match ends at its first possible end instead, which
+ * keeps a row's scan linear in its length. */
+#define RE_MAX_INSTS 4096
+#define RE_MAX_DEPTH 256
+#define RE_MAX_REPEAT 1000
+#define RE_DFA_STATES 4096 // the state cache is dropped when it fills
+#define RE_SCAN_FACTOR 16   // forward bytes per row byte before matches are cut short
+#define RE_MAX_LITERAL 32
+
+enum reOp {
+	RE_BYTE, // x indexes the byte set
+	RE_SPLIT,
+	RE_JMP,
+	RE_BOL,
+	RE_EOL,
+	RE_MATCH
+};
+
+struct reInst {
+	int op;
+	int x, y; // jump targets
+};
+
+struct reProg {
+	struct reInst *insts;
+	int n, cap;
+	bool full;
+};
+
+enum reNodeType {
+	RE_N_EMPTY,
+	RE_N_SET,
+	RE_N_CAT,
+	RE_N_ALT,
+	RE_N_REPEAT,
+	RE_N_BOL,
+	RE_N_EOL
+};
+
+struct reNode {
+	int type;
+	int a, b;     // children; the set of RE_N_SET
+	int min, max; // RE_N_REPEAT, max < 0 when unbounded
+};
+
+typedef struct regex {
+	struct reProg fwd, rev; // rev matches the reversed text
+	unsigned char (*sets)[32];
+	int nsets;
+	unsigned char classes[256]; // bytes no set tells apart share a class
+	unsigned char repr[256];    // a byte of each class
+	int nclasses;
+	char literal[RE_MAX_LITERAL]; // bytes every match contains
+	int literal_len;
+} regex;
+
+struct reParser {
+	const char *p;
+	int depth;
+	const char *err;
+	struct reNode *nodes;
+	int n, cap;
+	regex *re;
+	int setcap;
+};
+
+struct reState {
+	int set, n; // NFA instructions, in reDfa.sets
+	bool match;     // a match ends before the next byte
+	bool match_end; // or the text may end here
+};
+
+struct reDfa {
+	regex *re;
+	struct reProg *prog;
+	bool anchored; // otherwise a match may begin at any byte
+	struct reState *states;
+	int nstates, cap;
+	int *next; // nstates * nclasses transitions, -1 until computed
+	int dead;  // the state that can never match, or -1
+	int *sets;
+	int nsets, setcap;
+	int *table; // open-addressed state lookup
+	int start[2]; // by at start of text
+	int *begin;   // where a match may begin after the first byte
+	int nbegin;
+	int *list, *stack;
+	unsigned int *mark, gen;
+	unsigned int flushes;
+};
+
+struct reMatcher {
+	regex *re;
+	struct reDfa fwd, rev;
+	unsigned char *starts;
+	int cap;
+};
+
+static inline void reSetAdd(unsigned char *set, int lo, int hi) {
+	for (int c = lo; c <= hi; c++)
+		set[c >> 3] |= 1 << (c & 7);
+}
+
+static inline bool reSetHas(const unsigned char *set, int c) {
+	return set[c >> 3] & (1 << (c & 7));
+}
+
+int reNode(struct reParser *ps, int type, int a, int b) {
+	if (ps->n == ps->cap) {
+		ps->cap = ps->cap ? ps->cap * 2 : 32;
+		ps->nodes = realloc(ps->nodes, sizeof(struct reNode) * ps->cap);
+		if (ps->nodes == NULL)
+			die("realloc");
+	}
+	ps->nodes[ps->n] = (struct reNode){type, a, b, 0, 0};
+	return ps->n++;
+}
+
+/* A node matching one byte of a new, empty set. */
+int reSetNode(struct reParser *ps) {
+	regex *re = ps->re;
+	if (re->nsets == ps->setcap) {
+		ps->setcap = ps->setcap ? ps->setcap * 2 : 16;
+		re->sets = realloc(re->sets, 32 * ps->setcap);
+		if (re->sets == NULL)
+			die("realloc");
+	}
+	memset(re->sets[re->nsets], 0, 32);
+	return reNode(ps, RE_N_SET, re->nsets++, 0);
+}
+
+/* Adds the bytes of an escape to set; false if it is not one. */
+bool reEscape(unsigned char *set, int c) {
+	unsigned char class[32] = {0};
+	switch (tolower(c)) {
+		case 'd':
+			reSetAdd(class, '0', '9');
+			break;
+		case 'w':
+			reSetAdd(class, '0', '9');
+			reSetAdd(class, 'A', 'Z');
+			reSetAdd(class, 'a', 'z');
+			reSetAdd(class, '_', '_');
+			break;
+		case 's':
+			reSetAdd(class, '\t', '\r');
+			reSetAdd(class, ' ', ' ');
+			break;
+		default:
+			if (c == 't')
+				c = '\t';
+			else if (isalnum(c) || c == '\0')
+				return false;
+			reSetAdd(set, c, c);
+			return true;
+	}
+	for (int i = 0; i < 32; i++)
+		set[i] |= isupper(c) ? ~class[i] : class[i];
+	return true;
+}
+
+int reParseClass(struct reParser *ps) {
+	int node = reSetNode(ps);
+	unsigned char *set = ps->re->sets[ps->nodes[node].a];
+	bool negate = *ps->p == '^';
+	if (negate)
+		ps->p++;
+	const char *first = ps->p;
+	while (*ps->p && (*ps->p != ']' || ps->p == first)) {
+		int lo = (unsigned char)*ps->p++;
+		if (lo == '\\') {
+			int c = (unsigned char)*ps->p++;
+			if (c && strchr("dDwWsS", c)) {
+				reEscape(set, c);
+				continue;
+			}
+			unsigned char one[32] = {0};
+			if (!reEscape(one, c)) {
+				ps->err = c ? "unknown escape" : "missing ]";
+				return -1;
+			}
+			lo = c == 't' ? '\t' : c;
+		}
+		int hi = lo;
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			hi = (unsigned char)ps->p[1];
+			ps->p += 2;
+			if (hi == '\\' && *ps->p) {
+				hi = (unsigned char)*ps->p++;
+				if (hi == 't')
+					hi = '\t';
+			}
+			if (hi < lo) {
+				ps->err = "bad range";
+				return -1;
+			}
+		}
+		reSetAdd(set, lo, hi);
+	}
+	if (*ps->p != ']') {
+		ps->err = "missing ]";
+		return -1;
+	}
+	ps->p++;
+	if (negate)
+		for (int i = 0; i < 32; i++)
+			set[i] = ~set[i];
+	return node;
+}
+
+int reParseAlt(struct reParser *ps);
+
+int reParseAtom(struct reParser *ps) {
+	int c = (unsigned char)*ps->p++;
+	int node;
+	switch (c) {
+		case '(':
+			if (++ps->depth > RE_MAX_DEPTH) {
+				ps->err = "too deeply nested";
+				return -1;
+			}
+			node = reParseAlt(ps);
+			ps->depth--;
+			if (ps->err)
+				return -1;
+			if (*ps->p != ')') {
+				ps->err = "missing )";
+				return -1;
+			}
+			ps->p++;
+			return node;
+		case '*':
+		case '+':
+		case '?':
+			ps->err = "nothing to repeat";
+			return -1;
+		case '^':
+			return reNode(ps, RE_N_BOL, 0, 0);
+		case '$':
+			return reNode(ps, RE_N_EOL, 0, 0);
+		case '[':
+			return reParseClass(ps);
+		case '.':
+			node = reSetNode(ps);
+			memset(ps->re->sets[ps->nodes[node].a], 0xff, 32);
+			return node;
+		case '\\':
+			node = reSetNode(ps);
+			c = (unsigned char)*ps->p;
+			if (!reEscape(ps->re->sets[ps->nodes[node].a], c)) {
+				ps->err = c ? "unknown escape" : "trailing \\";
+				return -1;
+			}
+			ps->p++;
+			return node;
+		default:
+			node = reSetNode(ps);
+			reSetAdd(ps->re->sets[ps->nodes[node].a], c, c);
+			return node;
+	}
+}
+
+/* Reads {m}, {m,} or {m,n} at s; a brace that starts none of them is a
+ * literal. */
+bool reParseBounds(const char **s, int *min, int *max) {
+	const char *p = *s + 1;
+	if (!isdigit(*p))
+		return false;
+	*min = 0;
+	while (isdigit(*p) && *min <= RE_MAX_REPEAT)
+		*min = *min * 10 + *p++ - '0';
+	*max = *min;
+	if (*p == ',') {
+		p++;
+		*max = -1;
+		if (isdigit(*p)) {
+			*max = 0;
+			while (isdigit(*p) && *max <= RE_MAX_REPEAT)
+				*max = *max * 10 + *p++ - '0';
+		}
+	}
+	if (*p != '}')
+		return false;
+	*s = p + 1;
+	return true;
+}
+
+int reParseRepeat(struct reParser *ps) {
+	int node = reParseAtom(ps);
+	while (!ps->err) {
+		int min, max;
+		if (*ps->p == '*') {
+			min = 0, max = -1;
+			ps->p++;
+		} else if (*ps->p == '+') {
+			min = 1, max = -1;
+			ps->p++;
+		} else if (*ps->p == '?') {
+			min = 0, max = 1;
+			ps->p++;
+		} else if (*ps->p != '{' || !reParseBounds(&ps->p, &min, &max)) {
+			break;
+		} else if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max >= 0 && max < min)) {
+			ps->err = "bad repetition";
+			return -1;
+		}
+		node = reNode(ps, RE_N_REPEAT, node, 0);
+		ps->nodes[node].min = min;
+		ps->nodes[node].max = max;
+	}
+	return ps->err ? -1 : node;
+}
+
+int reParseAlt(struct reParser *ps) {
+	int node = -1;
+	while (1) {
+		int cat = reNode(ps, RE_N_EMPTY, 0, 0);
+		while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+			int next = reParseRepeat(ps);
+			if (ps->err)
+				return -1;
+			cat = ps->nodes[cat].type == RE_N_EMPTY ? next : reNode(ps, RE_N_CAT, cat, next);
+		}
+		node = node < 0 ? cat : reNode(ps, RE_N_ALT, node, cat);
+		if (*ps->p != '|')
+			return node;
+		ps->p++;
+	}
+}
+
+int reEmit(struct reProg *prog, int op, int x, int y) {
+	if (prog->n == RE_MAX_INSTS) {
+		prog->full = true;
+		return 0;
+	}
+	if (prog->n == prog->cap) {
+		prog->cap = prog->cap ? prog->cap * 2 : 64;
+		prog->insts = realloc(prog->insts, sizeof(struct reInst) * prog->cap);
+		if (prog->insts == NULL)
+			die("realloc");
+	}
+	prog->insts[prog->n] = (struct reInst){op, x, y};
+	return prog->n++;
+}
+
+void reCompileNode(struct reProg *prog, struct reNode *nodes, int i, bool reverse) {
+	struct reNode *node = &nodes[i];
+	int split, jmp;
+	if (prog->full)
+		return;
+	switch (node->type) {
+		case RE_N_SET:
+			reEmit(prog, RE_BYTE, node->a, 0);
+			break;
+		case RE_N_CAT:
+			reCompileNode(prog, nodes, reverse ? node->b : node->a, reverse);
+			reCompileNode(prog, nodes, reverse ? node->a : node->b, reverse);
+			break;
+		case RE_N_ALT:
+			split = reEmit(prog, RE_SPLIT, prog->n + 1, 0);
+			reCompileNode(prog, nodes, node->a, reverse);
+			jmp = reEmit(prog, RE_JMP, 0, 0);
+			prog->insts[split].y = prog->n;
+			reCompileNode(prog, nodes, node->b, reverse);
+			prog->insts[jmp].x = prog->n;
+			break;
+		case RE_N_REPEAT:
+			for (int k = 0; k < node->min; k++)
+				reCompileNode(prog, nodes, node->a, reverse);
+			if (node->max < 0) {
+				split = reEmit(prog, RE_SPLIT, prog->n + 1, 0);
+				reCompileNode(prog, nodes, node->a, reverse);
+				reEmit(prog, RE_JMP, split, 0);
+				prog->insts[split].y = prog->n;
+			} else {
+				/* x{1,3} is x(x(x)?)?; every skip goes to the end */
+				int first = prog->n;
+				for (int k = node->min; k < node->max; k++) {
+					reEmit(prog, RE_SPLIT, prog->n + 1, 0);
+					reCompileNode(prog, nodes, node->a, reverse);
+				}
+				for (int pc = first; pc < prog->n && !prog->full; pc++)
+					if (prog->insts[pc].op == RE_SPLIT && prog->insts[pc].y == 0)
+						prog->insts[pc].y = prog->n;
+			}
+			break;
+		case RE_N_BOL:
+			reEmit(prog, reverse ? RE_EOL : RE_BOL, 0, 0);
+			break;
+		case RE_N_EOL:
+			reEmit(prog, reverse ? RE_BOL : RE_EOL, 0, 0);
+			break;
+	}
+}
+
+struct reLiteral {
+	char s[RE_MAX_LITERAL];
+	int len;
+};
+
+/* Collects runs of bytes that every match of node holds in a row,
+ * keeping the longest in best. A row without it needs no scan. */
+void reFindLiteral(struct reParser *ps, int i, struct reLiteral *run, struct reLiteral *best) {
+	struct reNode *node = &ps->nodes[i];
+	int byte = -1;
+	switch (node->type) {
+		case RE_N_SET:
+			for (int c = 0; c < 256; c++) {
+				if (!reSetHas(ps->re->sets[node->a], c))
+					continue;
+				if (byte >= 0) {
+					byte = -1;
+					break;
+				}
+				byte = c;
+			}
+			if (byte < 0 || run->len == RE_MAX_LITERAL) {
+				run->len = 0;
+				return;
+			}
+			run->s[run->len++] = byte;
+			if (run->len > best->len)
+				*best = *run;
+			return;
+		case RE_N_CAT:
+			reFindLiteral(ps, node->a, run, best);
+			reFindLiteral(ps, node->b, run, best);
+			return;
+		case RE_N_REPEAT:
+			run->len = 0;
+			if (node->min > 0)
+				reFindLiteral(ps, node->a, run, best);
+			run->len = 0;
+			return;
+		case RE_N_ALT:
+			run->len = 0;
+			return;
+		default: // zero width
+			return;
+	}
+}
+
+void reFree(regex *re) {
+	if (re == NULL)
+		return;
+	free(re->fwd.insts);
+	free(re->rev.insts);
+	free(re->sets);
+	free(re);
+}
+
+/* Compiles pattern; on error returns NULL and sets *err. */
+regex *reCompile(const char *pattern, const char **err) {
+	regex *re = calloc(1, sizeof(regex));
+	if (re == NULL)
+		die("calloc");
+	struct reParser ps = {.p = pattern, .re = re};
+	int root = reParseAlt(&ps);
+	if (ps.err == NULL && *ps.p == ')')
+		ps.err = "unmatched )";
+	if (ps.err == NULL) {
+		reCompileNode(&re->fwd, ps.nodes, root, false);
+		reEmit(&re->fwd, RE_MATCH, 0, 0);
+		reCompileNode(&re->rev, ps.nodes, root, true);
+		reEmit(&re->rev, RE_MATCH, 0, 0);
+		if (re->fwd.full || re->rev.full)
+			ps.err = "pattern too large";
+	}
+	if (ps.err == NULL) {
+		struct reLiteral run = {0}, best = {0};
+		reFindLiteral(&ps, root, &run, &best);
+		memcpy(re->literal, best.s, best.len);
+		re->literal_len = best.len;
+	}
+	free(ps.nodes);
+	if (ps.err) {
+		*err = ps.err;
+		reFree(re);
+		return NULL;
+	}
+
+	/* a class starts at every byte where some set changes */
+	for (int c = 0; c < 256; c++) {
+		bool split = c == 0;
+		for (int i = 0; i < re->nsets && !split; i++)
+			split = reSetHas(re->sets[i], c) != reSetHas(re->sets[i], c - 1);
+		if (split)
+			re->repr[re->nclasses++] = c;
+		re->classes[c] = re->nclasses - 1;
+	}
+	return re;
+}
+
+void reDfaFlush(struct reDfa *dfa) {
+	dfa->nstates = 0;
+	dfa->nsets = 0;
+	dfa->start[0] = dfa->start[1] = -1;
+	dfa->dead = -1;
+	memset(dfa->table, -1, sizeof(int) * RE_DFA_STATES * 2);
+	dfa->flushes++;
+}
+
+/* Adds to dfa->list the instructions reachable from pc without reading
+ * a byte: the ones that read one, matches, and end-of-text checks that
+ * are still pending. */
+int reClosure(struct reDfa *dfa, int n, int pc, bool bol, bool eol) {
+	struct reInst *insts = dfa->prog->insts;
+	int sp = 0;
+	dfa->stack[sp++] = pc;
+	while (sp) {
+		pc = dfa->stack[--sp];
+		if (dfa->mark[pc] == dfa->gen)
+			continue;
+		dfa->mark[pc] = dfa->gen;
+		switch (insts[pc].op) {
+			case RE_BYTE:
+			case RE_MATCH:
+				dfa->list[n++] = pc;
+				break;
+			case RE_EOL:
+				if (eol)
+					dfa->stack[sp++] = pc + 1;
+				else
+					dfa->list[n++] = pc;
+				break;
+			case RE_BOL:
+				if (bol)
+					dfa->stack[sp++] = pc + 1;
+				break;
+			case RE_JMP:
+				dfa->stack[sp++] = insts[pc].x;
+				break;
+			case RE_SPLIT:
+				dfa->stack[sp++] = insts[pc].y;
+				dfa->stack[sp++] = insts[pc].x;
+				break;
+		}
+	}
+	return n;
+}
+
+/* Whether a state with these instructions matches if the text ends. */
+bool reMatchesAtEnd(struct reDfa *dfa, const int *set, int n) {
+	struct reInst *insts = dfa->prog->insts;
+	int m = 0;
+	dfa->gen++;
+	for (int i = 0; i < n; i++) {
+		if (insts[set[i]].op == RE_MATCH)
+			return true;
+		if (insts[set[i]].op == RE_EOL)
+			m = reClosure(dfa, m, set[i] + 1, false, true);
+	}
+	for (int i = 0; i < m; i++)
+		if (insts[dfa->list[i]].op == RE_MATCH)
+			return true;
+	return false;
+}
+
+int reIntCmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Returns the state made of the n instructions in dfa->list. */
+int reIntern(struct reDfa *dfa, int n) {
+	qsort(dfa->list, n, sizeof(int), reIntCmp);
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < n; i++)
+		h = (h ^ dfa->list[i]) * 16777619u;
+	int mask = RE_DFA_STATES * 2 - 1;
+	int slot = h & mask;
+	for (; dfa->table[slot] >= 0; slot = (slot + 1) & mask) {
+		struct reState *s = &dfa->states[dfa->table[slot]];
+		if (s->n == n && (n == 0 || memcmp(&dfa->sets[s->set], dfa->list, sizeof(int) * n) == 0))
+			return dfa->table[slot];
+	}
+
+	if (dfa->nstates == RE_DFA_STATES) {
+		reDfaFlush(dfa);
+		return reIntern(dfa, n);
+	}
+	int nclasses = dfa->re->nclasses;
+	if (dfa->nstates == dfa->cap) {
+		dfa->cap = dfa->cap ? dfa->cap * 2 : 16;
+		dfa->states = realloc(dfa->states, sizeof(struct reState) * dfa->cap);
+		dfa->next = realloc(dfa->next, sizeof(int) * nclasses * dfa->cap);
+		if (dfa->states == NULL || dfa->next == NULL)
+			die("realloc");
+	}
+	if (dfa->nsets + n > dfa->setcap) {
+		dfa->setcap = (dfa->nsets + n) * 2;
+		dfa->sets = realloc(dfa->sets, sizeof(int) * dfa->setcap);
+		if (dfa->sets == NULL)
+			die("realloc");
+	}
+	int id = dfa->nstates++;
+	struct reState *s = &dfa->states[id];
+	s->set = dfa->nsets;
+	s->n = n;
+	if (n)
+		memcpy(&dfa->sets[s->set], dfa->list, sizeof(int) * n);
+	dfa->nsets += n;
+	memset(&dfa->next[id * nclasses], -1, sizeof(int) * nclasses);
+	dfa->table[slot] = id;
+
+	s->match = false;
+	for (int i = 0; i < n; i++)
+		s->match |= dfa->prog->insts[dfa->list[i]].op == RE_MATCH;
+	s->match_end = reMatchesAtEnd(dfa, &dfa->sets[s->set], n);
+	if (n == 0)
+		dfa->dead = id;
+	return id;
+}
+
+/* Transitions name the row of next[] of their target, shifted left by
+ * one, with whether it matches in the low bit: the scan loops then need
+ * one load per byte. */
+static inline int reDfaCode(struct reDfa *dfa, int id) {
+	return (id * dfa->re->nclasses) << 1 | dfa->states[id].match;
+}
+
+static inline struct reState *reDfaState(struct reDfa *dfa, int code) {
+	return &dfa->states[(code >> 1) / dfa->re->nclasses];
+}
+
+int reDfaStart(struct reDfa *dfa, bool bol) {
+	if (dfa->start[bol] < 0) {
+		dfa->gen++;
+		int id = reIntern(dfa, reClosure(dfa, 0, 0, bol, false));
+		dfa->start[bol] = id;
+	}
+	return dfa->start[bol];
+}
+
+/* Computes and caches the transition of a state on byte class c. */
+int reDfaStep(struct reDfa *dfa, int code, int c) {
+	regex *re = dfa->re;
+	int s = (code >> 1) / re->nclasses;
+	struct reInst *insts = dfa->prog->insts;
+	int byte = re->repr[c];
+	int n = 0;
+	dfa->gen++;
+	for (int i = 0; i < dfa->states[s].n; i++) {
+		int pc = dfa->sets[dfa->states[s].set + i];
+		if (insts[pc].op == RE_BYTE && reSetHas(re->sets[insts[pc].x], byte))
+			n = reClosure(dfa, n, pc + 1, false, false);
+	}
+	/* threads begun here have read the byte when the state is entered,
+	 * so a match it reports is never empty */
+	for (int i = 0; i < dfa->nbegin && !dfa->anchored; i++) {
+		int pc = dfa->begin[i];
+		if (insts[pc].op == RE_BYTE && reSetHas(re->sets[insts[pc].x], byte))
+			n = reClosure(dfa, n, pc + 1, false, false);
+	}
+	unsigned int flushes = dfa->flushes;
+	int t = reDfaCode(dfa, reIntern(dfa, n));
+	if (dfa->flushes == flushes)
+		dfa->next[s * re->nclasses + c] = t;
+	return t;
+}
+
+void reDfaInit(struct reDfa *dfa, regex *re, struct reProg *prog, bool anchored) {
+	memset(dfa, 0, sizeof(*dfa));
+	dfa->re = re;
+	dfa->prog = prog;
+	dfa->anchored = anchored;
+	dfa->table = malloc(sizeof(int) * RE_DFA_STATES * 2);
+	dfa->list = malloc(sizeof(int) * prog->n);
+	dfa->stack = malloc(sizeof(int) * (prog->n * 2 + 1));
+	dfa->mark = calloc(prog->n, sizeof(unsigned int));
+	dfa->begin = malloc(sizeof(int) * prog->n);
+	if (!dfa->table || !dfa->list || !dfa->stack || !dfa->mark || !dfa->begin)
+		die("malloc");
+	reDfaFlush(dfa);
+	dfa->gen++;
+	dfa->nbegin = reClosure(dfa, 0, 0, false, false);
+	memcpy(dfa->begin, dfa->list, sizeof(int) * dfa->nbegin);
+}
+
+void reDfaFree(struct reDfa *dfa) {
+	free(dfa->states);
+	free(dfa->next);
+	free(dfa->sets);
+	free(dfa->table);
+	free(dfa->list);
+	free(dfa->stack);
+	free(dfa->mark);
+	free(dfa->begin);
+}
+
+void reMatcherInit(struct reMatcher *m, regex *re) {
+	m->re = re;
+	reDfaInit(&m->fwd, re, &re->fwd, true);
+	reDfaInit(&m->rev, re, &re->rev, false);
+	m->starts = NULL;
+	m->cap = 0;
+}
+
+void reMatcherFree(struct reMatcher *m) {
+	if (m->re == NULL)
+		return;
+	reDfaFree(&m->fwd);
+	reDfaFree(&m->rev);
+	free(m->starts);
+	m->re = NULL;
+}
+
+/* Scans s backwards and marks in m->starts where a match begins; returns
+ * whether any does. */
+bool reStarts(struct reMatcher *m, const char *s, int n) {
+	struct reDfa *dfa = &m->rev;
+	const unsigned char *classes = m->re->classes;
+	if (n > m->cap) {
+		m->cap = n * 2;
+		free(m->starts);
+		m->starts = malloc(m->cap);
+		if (m->starts == NULL)
+			die("malloc");
+	}
+	int any = 0;
+	int code = reDfaCode(dfa, reDfaStart(dfa, true));
+	for (int i = n - 1; i >= 0; i--) {
+		int c = classes[(unsigned char)s[i]];
+		int next = dfa->next[(code >> 1) + c];
+		code = next >= 0 ? next : reDfaStep(dfa, code, c);
+		m->starts[i] = code & 1;
+		any |= code;
+	}
+	if (n && reDfaState(dfa, code)->match_end)
+		any = m->starts[0] = 1;
+	return any & 1;
+}
+
+/* End of the longest match starting at from, or -1. Bytes read are taken
+ * from *budget; once it runs out the first match found is returned. */
+int reLongest(struct reMatcher *m, const char *s, int n, int from, long *budget) {
+	struct reDfa *dfa = &m->fwd;
+	const unsigned char *classes = m->re->classes;
+	int code = reDfaCode(dfa, reDfaStart(dfa, from == 0));
+	int end = code & 1 ? from : -1;
+	int i;
+	for (i = from; i < n && (code >> 1) != dfa->dead * dfa->re->nclasses; i++) {
+		if (end >= 0 && i - from >= *budget)
+			break;
+		int c = classes[(unsigned char)s[i]];
+		int next = dfa->next[(code >> 1) + c];
+		code = next >= 0 ? next : reDfaStep(dfa, code, c);
+		if (code & 1)
+			end = i + 1;
+	}
+	*budget -= i - from;
+	if (i == n && reDfaState(dfa, code)->match_end)
+		end = n;
+	return end;
+}
+
+/* Counts the non-overlapping, non-empty matches in s[0..n); with spans
+ * set it also stores the start and length of each. */
+int reMatch(struct reMatcher *m, const char *s, int n, int *spans) {
+	regex *re = m->re;
+	if (re->literal_len && !editorFindBytes(s, n, re->literal, re->literal_len))
+		return 0;
+	if (!reStarts(m, s, n))
+		return 0;
+	int count = 0;
+	long budget = (long)n * RE_SCAN_FACTOR;
+	for (int i = 0; i < n; i++) {
+		const unsigned char *next = memchr(&m->starts[i], 1, n - i);
+		if (next == NULL)
+			break;
+		i = next - m->starts;
+		int end = reLongest(m, s, n, i, &budget);
+		if (end <= i)
+			continue;
+		if (spans) {
+			spans[count * 2] = i;
+			spans[count * 2 + 1] = end - i;
+		}
+		count++;
+		i = end - 1;
+	}
+	return count;
+}
+
+/* search */
+/* The match index of the last query: every row containing it, in buffer
+ * order, with how many (non-overlapping) matches it holds and how many
+ * come before it. Rows are searched in slices on the thread pool; while
+ * a literal query only grows just the rows already in the index are
+ * searched again. The index lives only while the search prompt is open,
+ * when the buffer cannot change, and is dropped when it closes. Where the
+ * matches are in a row is looked up when it is first needed, for drawing
+ * or jumping to one. */
+#define KILO_SEARCH_SLICE_ROWS 16384 // smaller buffers are searched on one thread
+
+struct searchRow {
+	int row;
+	int count;
+	int rank;
+	unsigned int version; // of the row when hits was filled
+	int *hits;            // start and length of each match, or NULL
+};
+
+struct {
+	char *query;
+	int len;
+	bool regex;
+	regex *re;
+	struct reMatcher matcher; // for the main thread
+	const char *err;          // the regex did not compile
+	struct searchRow *rows;
+	int n, cap;
+	int total;   // matches in the buffer
+	bool ranked; // rank and total are up to date
+	bool show;   // highlight the matches on screen
+} search;
+
+struct searchSlice {
+	struct searchRow *rows;
+	int n, cap;
+	struct reMatcher matcher;
+};
+
+struct searchJob {
+	const char *query;
+	int len;
+	regex *re; // or NULL for a literal query
+	int nrows; // rows (or index entries) to search
+	struct searchSlice slice[KILO_POOL_THREADS];
+};
+
+void searchDropHits(struct searchRow *e) {
+	free(e->hits);
+	e->hits = NULL;
 }
 
-void editorRowDelChars(erow *row, int at, int until) {
-	if (at < 0 || at >= row->size)
-		return;
-	memmove(&row->chars[until], &row->chars[at + 1], row->size - at);
-	row->size -= at + 1 - until;
-	editorUpdateRow(row);
-	E.dirty++;
+void editorSearchReset() {
+	free(search.query);
+	reMatcherFree(&search.matcher);
+	reFree(search.re);
+	for (int i = 0; i < search.n; i++)
+		searchDropHits(&search.rows[i]);
+	free(search.rows);
+	memset(&search, 0, sizeof(search));
 }
 
-/* editor operations */
-void editorInsertChar(int c) {
-	if (E.cy == E.numrows)
-		editorInsertRow(E.numrows, "", 0);
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+/* Matches of the query in s; m is set for a regex. */
+int searchCount(const char *s, int n, const char *query, int len, struct reMatcher *m) {
+	if (m)
+		return reMatch(m, s, n, NULL);
+	int count = 0;
+	const char *end = s + n;
+	while (len && (s = editorFindBytes(s, end - s, query, len))) {
+		count++;
+		s += len;
+	}
+	return count;
 }
 
-void editorInsertNewline() {
-	int il = 0; // indentation level to smart-indent
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
-	} else {
-		erow *row = &E.row[E.cy];
+/* The matches of index entry e, which is row. */
+int *searchHits(struct searchRow *e, erow *row) {
+	if (e->hits && e->version == row->version)
+		return e->hits;
+	e->hits = realloc(e->hits, sizeof(int) * 2 * e->count);
+	if (e->hits == NULL)
+		die("realloc");
+	e->version = row->version;
+	if (search.re) {
+		reMatch(&search.matcher, row->chars, row->size, e->hits);
+		return e->hits;
+	}
+	const char *p = row->chars;
+	const char *end = row->chars + row->size;
+	for (int k = 0; k < e->count; k++) {
+		p = editorFindBytes(p, end - p, search.query, search.len);
+		e->hits[k * 2] = p - row->chars;
+		e->hits[k * 2 + 1] = search.len;
+		p += search.len;
+	}
+	return e->hits;
+}
 
-		/* smart-indent */
-		char indented[row->size];
-		for (il = 0; il < E.cx && (row->chars[il] == '\t' || row->chars[il] == ' '); il++)
-			indented[il] = row->chars[il];
-		memcpy(&indented[il], &row->chars[E.cx], row->size - E.cx);
+/* Returns the row `at`, walking from `row` (row number `idx`) when it is
+ * close by and descending the rope otherwise. */
+erow *searchSeek(erow *row, int idx, int at) {
+	if (row == NULL || at < idx || at - idx > 64)
+		return editorRowAt(at);
+	for (; idx < at; idx++)
+		row = editorRowNext(row);
+	return row;
+}
 
-		editorInsertRow(E.cy + 1, indented, il + row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+void searchScanSlice(int slice, int nslices, void *arg) {
+	struct searchJob *job = arg;
+	struct searchSlice *out = &job->slice[slice];
+	int from = (long long)job->nrows * slice / nslices;
+	int to = (long long)job->nrows * (slice + 1) / nslices;
+	struct reMatcher *m = NULL;
+	if (job->re) {
+		m = &out->matcher;
+		reMatcherInit(m, job->re);
+	}
+	erow *row = editorRowAt(from);
+	for (int i = from; i < to; i++, row = editorRowNext(row)) {
+		int count = searchCount(row->chars, row->size, job->query, job->len, m);
+		if (count == 0)
+			continue;
+		if (out->n == out->cap) {
+			out->cap = out->cap ? out->cap * 2 : 256;
+			out->rows = realloc(out->rows, sizeof(struct searchRow) * out->cap);
+			if (out->rows == NULL)
+				die("realloc");
+		}
+		out->rows[out->n++] = (struct searchRow){i, count, 0, 0, NULL};
 	}
-	E.cy++;
-	E.cx = 0;
-	for (int j = 0; j < il; j++)
-		editorMoveCursor(ARROW_RIGHT);
 }
 
-void editorDelChar() {
-	if (E.cy == E.numrows)
-		return;
-	if (E.cx == 0 && E.cy == 0)
-		return;
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
-	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+/* Re-counts the index entries of one slice; rows left without matches
+ * get a count of 0 and are dropped afterwards. */
+void searchNarrowSlice(int slice, int nslices, void *arg) {
+	struct searchJob *job = arg;
+	int from = (long long)job->nrows * slice / nslices;
+	int to = (long long)job->nrows * (slice + 1) / nslices;
+	erow *row = NULL;
+	int idx = 0;
+	for (int i = from; i < to; i++) {
+		struct searchRow *e = &search.rows[i];
+		row = searchSeek(row, idx, e->row);
+		idx = e->row;
+		e->count = searchCount(row->chars, row->size, job->query, job->len, NULL);
+		searchDropHits(e);
 	}
 }
 
-/* file io */
-char *editorRowsToString(int *buflen) {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; j++)
-		totlen += E.row[j].size + 1;
-	*buflen = totlen;
-
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+/* Indexes the matches of query, a regular expression when is_regex is set;
+ * returns why it would not compile, or NULL. */
+const char *editorSearchUpdate(const char *query, bool is_regex) {
+	int len = strlen(query);
+	if (search.query && search.regex == is_regex && strcmp(query, search.query) == 0)
+		return search.err;
+
+	regex *re = NULL;
+	const char *err = NULL;
+	if (is_regex && len && (re = reCompile(query, &err)) == NULL)
+		len = 0;
+
+	struct searchJob job = {.query = query, .len = len, .re = re};
+	if (!is_regex && !search.regex && search.len && strstr(query, search.query) != NULL) {
+		job.nrows = search.n;
+		poolRun(searchNarrowSlice, &job, search.n >= KILO_SEARCH_SLICE_ROWS);
+		int n = 0;
+		for (int i = 0; i < search.n; i++)
+			if (search.rows[i].count)
+				search.rows[n++] = search.rows[i];
+		search.n = n;
+	} else {
+		job.nrows = len ? E.numrows : 0;
+		poolRun(searchScanSlice, &job, job.nrows >= KILO_SEARCH_SLICE_ROWS);
+		for (int i = 0; i < search.n; i++)
+			searchDropHits(&search.rows[i]);
+		search.n = 0;
+		for (int i = 0; i < KILO_POOL_THREADS; i++) {
+			struct searchSlice *sl = &job.slice[i];
+			if (search.n + sl->n > search.cap) {
+				search.cap = (search.n + sl->n) * 2;
+				search.rows = realloc(search.rows, sizeof(struct searchRow) * search.cap);
+				if (search.rows == NULL)
+					die("realloc");
+			}
+			if (sl->n)
+				memcpy(&search.rows[search.n], sl->rows, sizeof(struct searchRow) * sl->n);
+			search.n += sl->n;
+			free(sl->rows);
+			reMatcherFree(&sl->matcher);
+		}
 	}
 
-	return buf;
+	free(search.query);
+	reMatcherFree(&search.matcher);
+	reFree(search.re);
+	search.query = strdup(query);
+	search.len = len;
+	search.regex = is_regex;
+	search.re = re;
+	if (re)
+		reMatcherInit(&search.matcher, re);
+	search.err = err;
+	search.ranked = false;
+	return err;
 }
 
-void editorOpen(char *filename) {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	editorSelectSyntaxHighlight();
-
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
-
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(E.numrows, line, linelen);
+/* Position of the first index entry whose row is at or after `at`. */
+int searchLowerBound(int at) {
+	int lo = 0, hi = search.n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (search.rows[mid].row < at)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+	return lo;
 }
 
-void editorSave() {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s", NULL);
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
+/* Number of matches in the buffer. */
+int editorSearchTotal() {
+	if (!search.ranked) {
+		search.total = 0;
+		for (int i = 0; i < search.n; i++) {
+			search.rows[i].rank = search.total;
+			search.total += search.rows[i].count;
 		}
-		editorSelectSyntaxHighlight();
+		search.ranked = true;
 	}
+	return search.total;
+}
 
-	int len;
-	char *buf = editorRowsToString(&len);
-
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
+/* The runs to draw row `at` with: its own, or while a search is shown,
+ * with the matches in it marked. */
+hlSpan *editorSearchSpans(erow *row, int at) {
+	if (!search.show || search.n == 0)
+		return editorRowSpans(row);
+	int i = searchLowerBound(at);
+	if (i == search.n || search.rows[i].row != at)
+		return editorRowSpans(row);
+
+	struct searchRow *e = &search.rows[i];
+	int *hits = searchHits(e, row);
+	unsigned char *hl = editorRowHl(row);
+	bool tabs = row->render != row->chars;
+	for (int k = 0; k < e->count; k++) {
+		int from = hits[k * 2];
+		int to = from + hits[k * 2 + 1];
+		if (tabs) {
+			from = editorRowCxToRx(row, from);
+			to = editorRowCxToRx(row, to);
 		}
-		close(fd);
+		memset(&hl[from], HL_MATCH, to - from);
 	}
+	int n;
+	return editorHlSpans(hl, row->rsize, &n);
+}
+
+void editorSearchShow(bool show) {
+	search.show = show;
+}
 
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+/* Finds the k-th match of the buffer, k < editorSearchTotal(); returns
+ * its row and sets *col and *len. */
+int editorSearchMatch(int k, int *col, int *len) {
+	editorSearchTotal();
+	int lo = 0, hi = search.n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (search.rows[mid].rank <= k)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	struct searchRow *e = &search.rows[lo];
+	int *hits = searchHits(e, editorRowAt(e->row));
+	*col = hits[(k - e->rank) * 2];
+	*len = hits[(k - e->rank) * 2 + 1];
+	return e->row;
 }
 
 /* find */
+bool find_regex;
+
 void editorFindCallback(char *query, int key) {
-	static int last_match = -1;
+	static int last_match = -1; // rank of the match shown
 	static int direction = 1;
 
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}
-
 	if (key == '\r' || key == '\x1b') {
 		last_match = -1;
 		direction = 1;
-		E.row[E.cy].damaged = true;
+		/* the index only lives while searching, so edits stay cheap */
+		editorSearchShow(false);
+		editorSearchReset();
 		return;
 	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
 		direction = 1;
@@ -767,40 +4019,44 @@ void editorFindCallback(char *query, int key) {
 		direction = 1;
 	}
 
-	if (last_match == -1)
-		direction = 1;
-	int current = last_match;
-	for (int i = 0; i < E.numrows; i++) {
-		current += direction;
-		if (current == -1)
-			current = E.numrows - 1;
-		else if (current == E.numrows)
-			current = 0;
-
-		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
+	const char *err = editorSearchUpdate(query, find_regex);
+	editorSearchShow(true);
+	if (err) {
+		int used = strlen(E.statusmsg);
+		snprintf(&E.statusmsg[used], sizeof(E.statusmsg) - used, " %s", err);
+		return;
+	}
+	if (editorSearchTotal() == 0) {
+		if (search.len) {
+			int used = strlen(E.statusmsg);
+			snprintf(&E.statusmsg[used], sizeof(E.statusmsg) - used, " no matches");
 		}
+		return;
 	}
+	if (last_match == -1)
+		last_match = 0;
+	else
+		last_match = (last_match + direction + search.total) % search.total;
+
+	int col, len;
+	E.cy = editorSearchMatch(last_match, &col, &len);
+	E.cx = col;
+	E.rowoff = E.numrows;
+
+	int used = strlen(E.statusmsg);
+	snprintf(&E.statusmsg[used], sizeof(E.statusmsg) - used,
+			" match %d of %d", last_match + 1, search.total);
 }
 
-void editorFind() {
+void editorFind(bool regex) {
 	int saved_cx = E.cx;
 	int saved_cy = E.cy;
 	int saved_coloff = E.coloff;
 	int saved_rowoff = E.rowoff;
 
-	char *query = editorPrompt("Search %s (Use ESC/Arrows/Enter)", editorFindCallback);
+	find_regex = regex;
+	char *query = editorPrompt(regex ? "Regex search %s (Use ESC/Arrows/Enter)" :
+			"Search %s (Use ESC/Arrows/Enter)", editorFindCallback, false);
 
 	if (query) {
 		free(query);
@@ -812,9 +4068,126 @@ void editorFind() {
 	}
 }
 
+/* replace */
+struct replaceRow {
+	erow *row;
+	char *chars;
+	unsigned char cap;
+	int size;
+};
+
+struct replaceJob {
+	const char *query, *with;
+	int len, wlen;
+	struct replaceRow *rows;
+	int n;
+};
+
+/* Writes the new text of a slice of the affected rows. */
+void replaceSlice(int slice, int nslices, void *arg) {
+	struct replaceJob *job = arg;
+	int from = (long long)job->n * slice / nslices;
+	int to = (long long)job->n * (slice + 1) / nslices;
+	for (int i = from; i < to; i++) {
+		erow *row = job->rows[i].row;
+		const char *p = row->chars;
+		const char *end = row->chars + row->size;
+		const char *match;
+		char *out = job->rows[i].chars;
+		while ((match = editorFindBytes(p, end - p, job->query, job->len))) {
+			memcpy(out, p, match - p);
+			out += match - p;
+			memcpy(out, job->with, job->wlen);
+			out += job->wlen;
+			p = match + job->len;
+		}
+		memcpy(out, p, end - p);
+		out[end - p] = '\0';
+	}
+}
+
+/* Replaces every occurrence of query, returning how many there were and
+ * setting *rows to the number of rows changed. The rows are found through
+ * the search index, and each affected row gets its new text in one block;
+ * render and hl are dropped and rebuilt like those of a freshly loaded
+ * row, so re-lexing happens in one pass from the first of them. */
+int editorReplaceAll(const char *query, const char *with, int *rows) {
+	editorSearchUpdate(query, false);
+	int total = editorSearchTotal();
+	*rows = search.n;
+	if (total == 0)
+		return 0;
+
+	struct replaceJob job = {query, with, strlen(query), strlen(with), NULL, search.n};
+	job.rows = malloc(sizeof(struct replaceRow) * job.n);
+	if (job.rows == NULL)
+		die("malloc");
+	erow *row = NULL;
+	int idx = 0;
+	for (int i = 0; i < job.n; i++) {
+		struct searchRow *e = &search.rows[i];
+		row = searchSeek(row, idx, e->row);
+		idx = e->row;
+		struct replaceRow *r = &job.rows[i];
+		r->row = row;
+		r->size = row->size + e->count * (job.wlen - job.len);
+		r->chars = storeAlloc(r->size + 1, &r->cap);
+	}
+	poolRun(replaceSlice, &job, job.n >= KILO_SEARCH_SLICE_ROWS);
+
+	for (int i = 0; i < job.n; i++) {
+		struct replaceRow *r = &job.rows[i];
+		row = r->row;
+		editorUndoRecord(UNDO_DELETE, search.rows[i].row, 0, row->chars, row->size);
+		editorUndoRecord(UNDO_INSERT, search.rows[i].row, 0, r->chars, r->size);
+		if (editorSaveHolds(row))
+			editorSaveDefer(row->chars, row->ccap);
+		else if (!row->mapped)
+			storeFree(row->chars, row->ccap);
+		editorRowInvalidate(row);
+		row->chars = r->chars;
+		row->ccap = r->cap;
+		row->size = r->size;
+		row->mapped = false;
+		E.dirty++;
+	}
+	editorSyntaxInvalidate(search.rows[0].row);
+	free(job.rows);
+	editorSearchReset();
+
+	if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size)
+		E.cx = editorRowAt(E.cy)->size;
+	return total;
+}
+
+void editorReplace() {
+	char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL, false);
+	if (query == NULL)
+		return;
+
+	/* the query goes into a format string */
+	char prompt[128] = "Replace ";
+	int len = strlen(prompt);
+	for (char *p = query; *p && len < (int)sizeof(prompt) - 32; p++) {
+		if (*p == '%')
+			prompt[len++] = '%';
+		prompt[len++] = *p;
+	}
+	snprintf(&prompt[len], sizeof(prompt) - len, " with: %%s");
+	char *with = editorPrompt(prompt, NULL, true);
+	if (with) {
+		int rows;
+		int count = editorReplaceAll(query, with, &rows);
+		editorSetStatusMessage("Replaced %d occurrence%s in %d line%s", count,
+				count == 1 ? "" : "s", rows, rows == 1 ? "" : "s");
+		free(with);
+	}
+	free(query);
+}
+
 /* jump */
 void editorJump() {
-	char *sline = editorPrompt("Jump to line: %s", NULL);
+	char *sline = editorPrompt("Jump to line: %s", NULL, false);
 	int sline_len = strlen(sline);
 
 	/* Poor workaround to treat VERY big line numbers */
@@ -839,35 +4212,378 @@ void editorJump() {
 }
 
 /* append buffer */
+/* Grows geometrically; the frame buffer keeps its storage between frames. */
 struct abuf {
 	char *b;
 	int len;
+	int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+/* Makes room for n more bytes and returns where they go. */
+char *abReserve(struct abuf *ab, int n) {
+	if (ab->len + n > ab->cap) {
+		int cap = ab->cap ? ab->cap : 4096;
+		while (cap < ab->len + n)
+			cap *= 2;
+		char *new = realloc(ab->b, cap);
+		if (new == NULL)
+			die("abReserve");
+		ab->b = new;
+		ab->cap = cap;
+	}
+	return &ab->b[ab->len];
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, (ab->len + len) * sizeof(char));
-
-	if (new == NULL)
-		return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
+	memcpy(abReserve(ab, len), s, len);
 	ab->len += len;
 }
 
 void abFree(struct abuf *ab) {
 	free(ab->b);
+	ab->b = NULL;
+	ab->len = ab->cap = 0;
 }
 
-/* output */
-bool editorScroll() {
-	int cur_rowoff = E.rowoff;
-	int cur_coloff = E.coloff;
+/* screen */
+/* Frames are drawn into a grid of cells (back) and compared with the cells
+ * the terminal is known to show (front); only the cells that differ are
+ * written, reached with the shortest cursor motion and with attributes
+ * changed only where they differ from the terminal's. */
+struct cell {
+	unsigned char ch;
+	unsigned char attr;
+};
+
+/* Attributes: the foreground color in the low bits (0 for the default,
+ * 1..8 for SGR 30..37) and reverse video. */
+#define ATTR_INVERSE 0x10
+#define ATTR_UNKNOWN 0x20
+#define ATTR(fg, inverse) (((fg) ? (fg) - 29 : 0) | ((inverse) ? ATTR_INVERSE : 0))
+
+#define CELL_BLANK ((struct cell){' ', 0})
+
+/* A short escape sequence, ready to copy. */
+struct seq {
+	unsigned char len;
+	char s[15];
+};
+
+struct screen {
+	struct cell *front, *back;
+	/* rows holding bytes >= 0x80, which may take fewer columns than
+	 * bytes; they are rewritten whole when they change */
+	bool *raw, *front_raw;
+	int rows, cols;
+	int cx, cy; // terminal cursor, -1 when unknown (cx also past the last column)
+	int attr; // terminal attributes, ATTR_UNKNOWN when unknown
+	bool stale; // terminal contents unknown
+	int scroll_top, scroll_bottom, scroll; // shift pending for the next flush
+	struct abuf out; // output of the frame being flushed
+	struct seq *num; // decimal numbers 0..max(rows, cols) for CUP and friends
+	struct seq sgr[ATTR_UNKNOWN + 1][ATTR_UNKNOWN]; // [from][to] attributes
+};
+
+struct screen screen;
+
+/* The terminal may have redrawn or reflowed: repaint everything next frame. */
+void screenInvalidate() {
+	screen.stale = true;
+}
+
+bool cellEqual(struct cell a, struct cell b) {
+	return a.ch == b.ch && a.attr == b.attr;
+}
+
+/* Fills screen.sgr with the shortest SGR sequence between every pair of
+ * attributes. */
+void screenInitSgr() {
+	for (int from = 0; from <= ATTR_UNKNOWN; from++) {
+		for (int to = 0; to < ATTR_UNKNOWN; to++) {
+			struct seq *q = &screen.sgr[from][to];
+			int fg = to & 0xf, inverse = to & ATTR_INVERSE;
+			if (from == to || fg > 8) {
+				q->len = 0;
+			} else if (to == 0) {
+				q->len = snprintf(q->s, sizeof(q->s), "\x1b[m");
+			} else {
+				bool set_inverse = from == ATTR_UNKNOWN || (from & ATTR_INVERSE) != inverse;
+				bool set_fg = from == ATTR_UNKNOWN || (from & 0xf) != fg;
+				q->len = snprintf(q->s, sizeof(q->s), "\x1b[%s%s%.0d%sm",
+						set_inverse ? (inverse ? "7" : "27") : "",
+						set_inverse && set_fg ? ";" : "",
+						set_fg && fg ? fg + 29 : 0, set_fg && !fg ? "39" : "");
+			}
+		}
+	}
+}
+
+/* Sizes the grids for the terminal; the front grid starts out matching no
+ * cell, so the next frame repaints everything. */
+void screenResize(int rows, int cols) {
+	if (rows < 0)
+		rows = 0;
+	if (cols < 0)
+		cols = 0;
+	size_t n = (size_t)rows * cols;
+	if (rows != screen.rows || cols != screen.cols || !screen.num) {
+		int max = rows > cols ? rows : cols;
+		free(screen.front);
+		free(screen.back);
+		free(screen.raw);
+		free(screen.front_raw);
+		free(screen.num);
+		screen.front = malloc(n * sizeof(struct cell) + 1);
+		screen.back = malloc(n * sizeof(struct cell) + 1);
+		screen.raw = calloc(rows + 1, sizeof(bool));
+		screen.front_raw = calloc(rows + 1, sizeof(bool));
+		screen.num = malloc((max + 1) * sizeof(struct seq));
+		if (!screen.front || !screen.back || !screen.raw || !screen.front_raw || !screen.num)
+			die("screenResize");
+		for (int i = 0; i <= max; i++)
+			screen.num[i].len = snprintf(screen.num[i].s, sizeof(screen.num[i].s), "%d", i);
+		if (screen.sgr[0][ATTR_INVERSE].len == 0)
+			screenInitSgr();
+		screen.rows = rows;
+		screen.cols = cols;
+	}
+	for (size_t i = 0; i < n; i++)
+		screen.front[i] = (struct cell){0, 0xff};
+	screen.cx = screen.cy = -1;
+	screen.attr = ATTR_UNKNOWN;
+	screen.stale = false;
+	screen.scroll = 0;
+}
+
+/* Clears row y of the back grid and returns it. */
+struct cell *screenLine(int y) {
+	struct cell *line = &screen.back[y * screen.cols];
+	for (int x = 0; x < screen.cols; x++)
+		line[x] = CELL_BLANK;
+	screen.raw[y] = false;
+	return line;
+}
+
+/* Puts s[0..len) at column x of row y, clipped to the screen. */
+void screenPut(int y, int x, const char *s, int len, int attr) {
+	struct cell *line = &screen.back[y * screen.cols];
+	unsigned char high = 0;
+	if (len > screen.cols - x)
+		len = screen.cols - x;
+	for (int i = 0; i < len; i++) {
+		line[x + i] = (struct cell){s[i], attr};
+		high |= s[i];
+	}
+	if (high & 0x80)
+		screen.raw[y] = true;
+}
+
+void screenAttr(int attr) {
+	struct seq *q = &screen.sgr[screen.attr][attr];
+	abAppend(&screen.out, q->s, q->len);
+	screen.attr = attr;
+}
+
+/* Appends "\x1b[<n><final>", or "\x1b[<final>" when n is 1 and may be left out. */
+void screenCsi(int n, char final) {
+	char *p = abReserve(&screen.out, 3 + sizeof(screen.num[0].s));
+	int len = 2;
+	p[0] = '\x1b';
+	p[1] = '[';
+	if (n != 1) {
+		memcpy(&p[2], screen.num[n].s, screen.num[n].len);
+		len += screen.num[n].len;
+	}
+	p[len++] = final;
+	screen.out.len += len;
+}
+
+/* Moves the terminal cursor to (x, y). A short hop to the right over cells
+ * already in the current attributes rewrites them instead of moving. */
+void screenMove(int x, int y) {
+	if (screen.cy == y && screen.cx == x)
+		return;
+	bool same_row = screen.cy == y && screen.cx >= 0;
+	if (same_row && x > screen.cx && x - screen.cx <= 3 && !screen.raw[y] && !screen.front_raw[y]) {
+		struct cell *line = &screen.back[y * screen.cols];
+		int j = screen.cx;
+		while (j < x && line[j].attr == screen.attr)
+			j++;
+		if (j == x) {
+			for (j = screen.cx; j < x; j++)
+				abAppend(&screen.out, (char *)&line[j].ch, 1);
+			screen.cx = x;
+			return;
+		}
+	}
+
+	if (same_row && x > screen.cx) {
+		screenCsi(x - screen.cx, 'C');
+	} else if (screen.cy == y && x == 0) {
+		abAppend(&screen.out, "\r", 1);
+	} else if (same_row) {
+		screenCsi(screen.cx - x, 'D');
+	} else if (screen.cy >= 0 && y == screen.cy + 1 && x == 0) {
+		abAppend(&screen.out, "\r\n", 2);
+	} else if (x == 0) {
+		screenCsi(y + 1, 'H');
+	} else {
+		char *p = abReserve(&screen.out, 4 + 2 * sizeof(screen.num[0].s));
+		struct seq *r = &screen.num[y + 1], *c = &screen.num[x + 1];
+		int len = 0;
+		p[len++] = '\x1b';
+		p[len++] = '[';
+		memcpy(&p[len], r->s, r->len);
+		len += r->len;
+		p[len++] = ';';
+		memcpy(&p[len], c->s, c->len);
+		len += c->len;
+		p[len++] = 'H';
+		screen.out.len += len;
+	}
+	screen.cx = x;
+	screen.cy = y;
+}
+
+/* Writes cells [x, end) of row y from the cursor, which is at x, with one
+ * SGR per run of equal attributes. */
+void screenPutCells(int y, int x, int end) {
+	struct cell *line = &screen.back[y * screen.cols];
+	int from = x;
+	while (x < end) {
+		int attr = line[x].attr;
+		int j = x + 1;
+		while (j < end && line[j].attr == attr)
+			j++;
+		screenAttr(attr);
+		char *p = abReserve(&screen.out, j - x);
+		for (int i = x; i < j; i++)
+			*p++ = line[i].ch;
+		screen.out.len += j - x;
+		x = j;
+	}
+	/* the cursor stays on the last column until the next character */
+	screen.cx += end - from;
+	if (screen.cx >= screen.cols)
+		screen.cx = -1;
+}
+
+/* Has the next flush move the content of rows [top, bottom) up by n rows
+ * (down when n < 0) with the terminal's own scrolling, so only the rows
+ * scrolled in differ from the front grid. */
+void screenScroll(int top, int bottom, int n) {
+	if (n == 0 || abs(n) >= bottom - top)
+		return;
+	screen.scroll_top = top;
+	screen.scroll_bottom = bottom;
+	screen.scroll = n;
+}
+
+/* Shifts the terminal and the front grid as screenScroll() asked, inside a
+ * scroll region (DECSTBM) with SU or SD. */
+void screenApplyScroll() {
+	int top = screen.scroll_top, bottom = screen.scroll_bottom, n = screen.scroll;
+	int cols = screen.cols;
+	screen.scroll = 0;
+
+	/* lines scrolled in take the current background */
+	screenAttr(0);
+	char buf[48];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r",
+			top + 1, bottom, abs(n), n > 0 ? 'S' : 'T');
+	abAppend(&screen.out, buf, len);
+	/* setting the region homes the cursor */
+	screen.cx = screen.cy = 0;
+
+	int keep = bottom - top - abs(n);
+	int from = n > 0 ? top + n : top, to = n > 0 ? top : top - n;
+	int clear = n > 0 ? top + keep : top;
+	memmove(&screen.front[to * cols], &screen.front[from * cols], (size_t)keep * cols * sizeof(struct cell));
+	memmove(&screen.front_raw[to], &screen.front_raw[from], keep * sizeof(bool));
+	for (int y = clear; y < clear + abs(n); y++) {
+		for (int x = 0; x < cols; x++)
+			screen.front[y * cols + x] = CELL_BLANK;
+		screen.front_raw[y] = false;
+	}
+}
+
+/* Writes the cells of the back grid that differ from the front one, then
+ * puts the cursor at (cx, cy). Nothing is written if nothing changed. */
+void screenFlush(int cx, int cy) {
+	struct abuf *out = &screen.out;
+	int cols = screen.cols;
+	bool hidden = false;
+	out->len = 0;
+
+	if (screen.scroll) {
+		abAppend(out, "\x1b[?25l", 6);
+		hidden = true;
+		screenApplyScroll();
+	}
+
+	for (int y = 0; y < screen.rows; y++) {
+		struct cell *back = &screen.back[y * cols];
+		struct cell *front = &screen.front[y * cols];
+		int end = cols;
+		while (end > 0 && cellEqual(back[end - 1], CELL_BLANK))
+			end--;
+
+		if (screen.raw[y] || screen.front_raw[y]) {
+			if (screen.raw[y] == screen.front_raw[y] &&
+					memcmp(back, front, cols * sizeof(struct cell)) == 0)
+				continue;
+			if (!hidden)
+				abAppend(out, "\x1b[?25l", 6);
+			hidden = true;
+			screenMove(0, y);
+			screenAttr(0);
+			abAppend(out, "\x1b[K", 3);
+			screenPutCells(y, 0, end);
+			screen.cx = -1;
+		} else {
+			/* a blank rest of the line is one erase */
+			int erase = cols - end > 3 ? end : cols;
+			for (int x = 0; x < cols; x++) {
+				if (cellEqual(back[x], front[x]))
+					continue;
+				if (!hidden)
+					abAppend(out, "\x1b[?25l", 6);
+				hidden = true;
+				screenMove(x, y);
+				if (x >= erase) {
+					screenAttr(screen.attr == ATTR_UNKNOWN ? 0 : screen.attr & ~ATTR_INVERSE);
+					abAppend(out, "\x1b[K", 3);
+					break;
+				}
+				int run = x + 1;
+				while (run < erase && !cellEqual(back[run], front[run]))
+					run++;
+				screenPutCells(y, x, run);
+				x = run - 1;
+			}
+		}
+		memcpy(front, back, cols * sizeof(struct cell));
+		screen.front_raw[y] = screen.raw[y];
+	}
+
+	if (out->len)
+		screenAttr(0);
+	screenMove(cx, cy);
+	if (hidden)
+		abAppend(out, "\x1b[?25h", 6);
+	if (out->len) {
+		struct iovec iov = {out->b, out->len};
+		writevAll(STDOUT_FILENO, &iov, 1);
+	}
+}
 
+/* output */
+void editorScroll() {
 	E.rx = 0;
 	if (E.cy < E.numrows)
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 
 	if (E.cy < E.rowoff)
 		E.rowoff = E.cy;
@@ -878,158 +4594,134 @@ bool editorScroll() {
 		E.coloff = E.rx;
 	if (E.rx >= E.coloff + E.screencols)
 		E.coloff = E.rx - E.screencols + 1;
-
-	return (cur_rowoff != E.rowoff || cur_coloff != E.coloff);
 }
 
-void editorDrawRows(struct abuf *ab) {
-	for (int y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows) {
-			char position[32];
-			int position_len = snprintf(position, sizeof(position), "\x1b[%d;1H", y + 1);
-			abAppend(ab, position, position_len);
-			if (E.numrows == 0 && y == E.screenrows / 3) {
+void editorDrawRows() {
+	int rows = screen.rows - 2;
+	erow *row = editorRowAt(E.rowoff);
+	for (int y = 0; y < rows; y++, row = row ? editorRowNext(row) : NULL) {
+		screenLine(y);
+		if (row == NULL) {
+			screenPut(y, 0, "~", 1, 0);
+			if (E.numrows == 0 && y == rows / 3) {
 				char welcome[80];
 				int welcomelen = snprintf(welcome, sizeof(welcome), 
 						"Kilo editor -- version %s", KILO_VERSION);
-				if (welcomelen > E.screencols)
-					welcomelen = E.screencols;
-				int padding = (E.screencols - welcomelen) / 2;
-				if (padding) {
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding--)
-					abAppend(ab, " ", 1);
-				abAppend(ab, welcome, welcomelen);
-			} else {
-				abAppend(ab, "~", 3);
-			}
-			abAppend(ab, "\x1b[K", 3);
-		} else {
-			if (!E.row[filerow].damaged)
-				continue;
-			E.row[filerow].damaged = false;
-			char position[32];
-			int position_len = snprintf(position, sizeof(position), "\x1b[%d;1H", y + 1);
-			abAppend(ab, position, position_len);
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0)
-				len = 0;
-			if (len > E.screencols)
-				len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_color = -1;
-			for (int j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b]%dm", current_color);
-						abAppend(ab, buf, clen);
-					} else {
-						abAppend(ab, "\x1b[m", 3);
-					}
-				} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				} else if (hl[j] == HL_MATCH) {
-					if (current_color != HL_MATCH) {
-						abAppend(ab, "\x1b[7m", 4);
-						current_color = HL_MATCH;
-					}
-					abAppend(ab, &c[j], 1);
-					if (j < len)
-						if (hl[j + 1] != HL_MATCH)
-							abAppend(ab, "\x1b[m", 3);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-						current_color = color;
-					}
-					abAppend(ab, &c[j], 1);
-				}
+				if (welcomelen > screen.cols)
+					welcomelen = screen.cols;
+				int padding = (screen.cols - welcomelen) / 2;
+				screenPut(y, padding, welcome, welcomelen, 0);
 			}
-			abAppend(ab, "\x1b[39m", 5);
+			continue;
 		}
 
-		abAppend(ab, "\x1b[m", 3);
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+		editorRowRender(row);
+		int len = row->rsize - E.coloff;
+		if (len < 0)
+			len = 0;
+		if (len > screen.cols)
+			len = screen.cols;
+		char *c = &row->render[E.coloff];
+		hlSpan *sp = editorSearchSpans(row, E.rowoff + y);
+		int skip = E.coloff;
+		while (len > 0 && (int)(*sp >> 8) <= skip)
+			skip -= *sp++ >> 8;
+		/* one run of equal highlight at a time, split at control
+		 * characters, which show as ^-letters in reverse video */
+		for (int j = 0; j < len; sp++) {
+			int run = (*sp >> 8) - skip;
+			unsigned char h = *sp & 0xff;
+			skip = 0;
+			if (run > len - j)
+				run = len - j;
+			int attr = h == HL_MATCH ? ATTR_INVERSE :
+					h == HL_NORMAL ? 0 : ATTR(editorSyntaxToColor(h), false);
+			for (int k = j; k < j + run; ) {
+				int span = editorFindCntrl(&c[k], j + run - k);
+				screenPut(y, k, &c[k], span, attr);
+				k += span;
+				if (k == j + run)
+					break;
+				char sym = (c[k] <= 26) ? '@' + c[k] : '?';
+				screenPut(y, k, &sym, 1, attr | ATTR_INVERSE);
+				k++;
+			}
+			j += run;
+		}
 	}
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-	char position[32];
-	int position_len = snprintf(position, sizeof(position), "\x1b[%d;1H", E.screenrows + 1);
-	abAppend(ab, position, position_len);
+void editorDrawStatusBar() {
+	int y = screen.rows - 2;
+	struct cell *line = screenLine(y);
+	for (int x = 0; x < screen.cols; x++)
+		line[x].attr = ATTR_INVERSE;
 
-	abAppend(ab, "\x1b[7m", 4);
 	char status[80], rstatus[80];
 	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
 			E.filename ? E.filename : "[NO NAME]", E.numrows, E.dirty ? "(modified)" : "");
 	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-	if (len > E.screencols)
-		len = E.screencols;
-	abAppend(ab, status, len);
-	while (len < E.screencols) {
-		if (E.screencols - len == rlen) {
-			abAppend(ab, rstatus, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
-	}
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
+	screenPut(y, 0, status, len, ATTR_INVERSE);
+	if (len <= screen.cols - rlen)
+		screenPut(y, screen.cols - rlen, rstatus, rlen, ATTR_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-	char position[32];
-	int position_len = snprintf(position, sizeof(position), "\x1b[%d;1H", E.screenrows + 2);
-	abAppend(ab, position, position_len);
-
-	abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+	int y = screen.rows - 1;
+	screenLine(y);
 	int msglen = strlen(E.statusmsg);
-	if (msglen > E.screencols)
-		msglen = E.screencols;
 	if (msglen && time(NULL) - E.statusmsg_time < 5)
-		abAppend(ab, E.statusmsg, msglen);
+		screenPut(y, 0, E.statusmsg, msglen, 0);
 }
 
-void editorRefreshScreen() {
-	if (editorScroll())
-		for (int i = 0; i < E.screenrows; i++)
-			E.row[i + E.rowoff].damaged = true;
-
-	struct abuf ab = ABUF_INIT;
-
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
-
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+/* Draws a frame unless more input is waiting, so a burst of keys (auto-repeat,
+ * typing ahead of a slow terminal) is drawn once, in its final state. With a
+ * frame cap, keys that arrive within the frame interval are also taken
+ * first. Input that never lets up is still shown every KILO_FRAME_STALL ms,
+ * or once per frame interval when the cap is slower than that. */
+void editorFrame() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - E.frame_time.tv_sec) * 1000 +
+		(now.tv_nsec - E.frame_time.tv_nsec) / 1000000;
+	int wait = elapsed < E.frame_interval ? E.frame_interval - elapsed : 0;
+	int stall = E.frame_interval > KILO_FRAME_STALL ? E.frame_interval : KILO_FRAME_STALL;
+	if (elapsed < stall) {
+		bool pending;
+		if (wait > 0) {
+			/* the highlighter and a finishing save need the lock meanwhile */
+			editorUnlock();
+			pending = editorInputPending(wait);
+			atomic_store(&E.lock_wanted, true);
+			editorLock();
+			atomic_store(&E.lock_wanted, false);
+		} else {
+			pending = editorInputPending(0);
+		}
+		if (pending)
+			return;
+	}
+	editorRefreshScreen();
+	clock_gettime(CLOCK_MONOTONIC, &E.frame_time);
+}
 
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+void editorRefreshScreen() {
+	editorScroll();
+	editorSyntaxResolve(E.rowoff + E.screenrows);
+
+	if (screen.stale || screen.rows != E.screenrows + 2 || screen.cols != E.screencols)
+		screenResize(E.screenrows + 2, E.screencols);
+	else
+		screenScroll(0, screen.rows - 2, E.rowoff - E.drawn_rowoff);
+	E.drawn_rowoff = E.rowoff;
+	if (screen.rows < 2)
+		return;
 
-	abAppend(&ab, "\x1b[?25h", 6);
+	editorDrawRows();
+	editorDrawStatusBar();
+	editorDrawMessageBar();
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	screenFlush(E.rx - E.coloff, E.cy - E.rowoff);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1041,16 +4733,19 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 
 /* input */
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+/* Reads a line in the status bar; NULL when cancelled with ESC. An empty
+ * line is only accepted with allow_empty. */
+char *editorPrompt(char *prompt, void (*callback)(char *, int), bool allow_empty) {
 	size_t bufsize = 128;
 	char *buf = malloc(bufsize);
 
 	size_t buflen = 0;
 	buf[0] = '\0';
 
+	E.prompting = true;
+	editorSetStatusMessage(prompt, buf);
 	while (1) {
-		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
+		editorFrame();
 
 		int c = editorReadKey();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1058,17 +4753,32 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 				buf[--buflen] = '\0';
 		} else if (c == '\x1b') {
 			editorSetStatusMessage("");
+			E.prompting = false;
 			if (callback)
 				callback(buf, c);
 			free(buf);
 			return NULL;
 		} else if (c == '\r') {
-			if (buflen != 0) {
+			if (buflen != 0 || allow_empty) {
 				editorSetStatusMessage("");
+				E.prompting = false;
 				if (callback)
 					callback(buf, c);
 				return buf;
 			}
+		} else if (c == PASTE) {
+			/* the first line of the paste, without control characters */
+			for (size_t i = 0; i < input.paste_len && input.paste[i] != '\r' &&
+					input.paste[i] != '\n'; i++) {
+				if (iscntrl((unsigned char)input.paste[i]) || (unsigned char)input.paste[i] >= 128)
+					continue;
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = input.paste[i];
+				buf[buflen] = '\0';
+			}
 		} else if (!iscntrl(c) && c < 128) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
@@ -1078,6 +4788,8 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 			buf[buflen] = '\0';
 		}
 
+		/* the callback may add to the prompt */
+		editorSetStatusMessage(prompt, buf);
 		if (callback)
 			callback(buf, c);
 	}
@@ -1085,7 +4797,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
 	static int keep_rx = 0; // Maintain cursor position on row change
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = editorRowAt(E.cy);
 
 	switch (key) {
 		case ARROW_LEFT:
@@ -1093,7 +4805,7 @@ void editorMoveCursor(int key) {
 				E.cx--;
 			} else if (E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			}
 			if (row)
 				keep_rx = editorRowCxToRx(row, E.cx);
@@ -1110,26 +4822,29 @@ void editorMoveCursor(int key) {
 			break;
 		case ARROW_UP:
 			if (E.cy != 0) {
-				E.cx = editorRowRxToCx(&E.row[E.cy - 1], keep_rx);
+				E.cx = editorRowRxToCx(editorRowAt(E.cy - 1), keep_rx);
 				E.cy--;
 			}
 			break;
 		case ARROW_DOWN:
 			if (E.cy < E.numrows) {
-				E.cx = editorRowRxToCx(&E.row[E.cy + 1], keep_rx);
+				erow *below = editorRowAt(E.cy + 1);
+				E.cx = below ? editorRowRxToCx(below, keep_rx) : 0;
 				E.cy++;
 			}
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	row = editorRowAt(E.cy);
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen)
 		E.cx = rowlen;
 }
 
 void editorMoveSelect(int key) {
-	erow *row = &E.row[E.cy];
+	erow *row = editorRowAt(E.cy);
+	if (row)
+		editorRowRender(row);
 
 	switch (key) {
 		case SHIFT_ARROW_LEFT:
@@ -1141,9 +4856,10 @@ void editorMoveSelect(int key) {
 						right = left + ((KILO_TAB_STOP - 1) - (left % KILO_TAB_STOP)) + 1;
 					else
 						right = left + 1;
+					unsigned char *hl = editorRowHl(row);
 					for (int i = left; i < right; i++)
-						row->hl[i] = row->hl[i] == HL_MATCH ? HL_NORMAL : HL_MATCH;
-					row->damaged = true;
+						hl[i] = hl[i] == HL_MATCH ? HL_NORMAL : HL_MATCH;
+					editorRowSetHl(row, hl);
 				}
 				editorMoveCursor(ARROW_LEFT);
 			}
@@ -1157,9 +4873,10 @@ void editorMoveSelect(int key) {
 						right = left + ((KILO_TAB_STOP - 1) - (left % KILO_TAB_STOP)) + 1;
 					else
 						right = left + 1;
+					unsigned char *hl = editorRowHl(row);
 					for (int i = left; i < right; i++)
-						row->hl[i] = row->hl[i] == HL_MATCH ? HL_NORMAL : HL_MATCH;
-					row->damaged = true;
+						hl[i] = hl[i] == HL_MATCH ? HL_NORMAL : HL_MATCH;
+					editorRowSetHl(row, hl);
 				}
 				editorMoveCursor(ARROW_RIGHT);
 				//if (E.cy >= E.numrows)
@@ -1169,7 +4886,8 @@ void editorMoveSelect(int key) {
 		case SHIFT_ARROW_DOWN:
 			{
 				int until_end = row->size - E.cx;
-				int until_below = editorRowRxToCx(&E.row[E.cy + 1], editorRowCxToRx(row, E.cx)); 
+				erow *below = editorRowAt(E.cy + 1);
+				int until_below = below ? editorRowRxToCx(below, editorRowCxToRx(row, E.cx)) : 0;
 				int until = until_end + until_below;
 				for (int i = 0; i <= until; i++)
 					editorMoveSelect(SHIFT_ARROW_RIGHT);
@@ -1178,7 +4896,8 @@ void editorMoveSelect(int key) {
 		case SHIFT_ARROW_UP:
 			{
 				int until_begin = E.cx;
-				int until_above = editorRowRxToCx(&E.row[E.cy - 1], editorRowCxToRx(row, row->size - E.cx));
+				erow *above = editorRowAt(E.cy - 1);
+				int until_above = above ? editorRowRxToCx(above, editorRowCxToRx(row, row->size - E.cx)) : 0;
 				int until = until_begin + until_above;
 				for (int i = 0; i <= until; i++)
 					editorMoveSelect(SHIFT_ARROW_LEFT);
@@ -1192,7 +4911,7 @@ void editorSelect(int key) {
 	editorMoveSelect(key);
 
 	while (1) {
-		editorRefreshScreen();
+		editorFrame();
 		int c = editorReadKey();
 
 		switch (c) {
@@ -1217,16 +4936,18 @@ void editorSelect(int key) {
 					}
 					if (up == down) {
 						int i, j; // begin, end
-						erow *row = &E.row[E.cy];
-						for (i = 0; row->hl[i] != HL_MATCH && i < row->rsize; i++);
-						for (j = i; row->hl[j] == HL_MATCH && j < row->rsize; j++);
+						erow *row = editorRowAt(E.cy);
+						unsigned char *hl = editorRowHl(row);
+						for (i = 0; hl[i] != HL_MATCH && i < row->rsize; i++);
+						for (j = i; hl[j] == HL_MATCH && j < row->rsize; j++);
 						editorRowDelChars(row, j - 1, i);
 						E.cx = editorRowRxToCx(row, i);
 					} else {
 						E.cy = down;
-						erow *row = &E.row[E.cy];
+						erow *row = editorRowAt(E.cy);
+						unsigned char *hl = editorRowHl(row);
 						int k;
-						for (k = row->rsize - 1; row->hl[k] != HL_MATCH && k > 0; k--);
+						for (k = row->rsize - 1; hl[k] != HL_MATCH && k > 0; k--);
 						if (k == row->size - 1)
 							editorDelRow(E.cy);
 						else
@@ -1234,18 +4955,20 @@ void editorSelect(int key) {
 						for (int i = down - 1; i > up; i--)
 							editorDelRow(i);
 						E.cy = up;
-						row = &E.row[E.cy];
-						for (k = row->rsize - 1; row->hl[k] == HL_MATCH && k > 0; k--);
+						row = editorRowAt(E.cy);
+						hl = editorRowHl(row);
+						for (k = row->rsize - 1; hl[k] == HL_MATCH && k > 0; k--);
 						k++;
 						if (k == 0)
 							editorDelRow(E.cy);
 						else {
 							editorRowDelChars(row, row->size - 1, k);
 							E.cy = up;
-							editorRowAppendString(&E.row[E.cy], E.row[E.cy + 1].chars, E.row[E.cy + 1].size);
+							erow *next = editorRowAt(E.cy + 1);
+							editorRowAppendString(editorRowAt(E.cy), next->chars, next->size);
 							editorDelRow(E.cy + 1);
 						}
-						E.cx = editorRowRxToCx(&E.row[E.cy], k);
+						E.cx = editorRowRxToCx(editorRowAt(E.cy), k);
 					}
 				}
 				return;
@@ -1270,10 +4993,9 @@ void editorSelect(int key) {
 						up = start_y;
 						down = E.cy;
 					}
-					for (int i = up; i <= down; i++) {
-						editorUpdateSyntax(&E.row[i]);
-						E.row[i].damaged = true;
-					}
+					erow *row = editorRowAt(up);
+					for (int i = up; i <= down && row; i++, row = editorRowNext(row))
+						editorUpdateSyntax(row);
 					editorProcessKeypress(c);
 				}
 				return;
@@ -1299,6 +5021,17 @@ void editorSelect(int key) {
 
 void editorProcessKeypress(int c) {
 	static int quit_times = KILO_QUIT_TIMES;
+	static int last_kind = 0;
+
+	/* a run of typed characters, or of deletions, is undone as one step */
+	int kind = 0;
+	if (c == '\t' || (c >= 32 && c < 256 && c != BACKSPACE))
+		kind = 1;
+	else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY)
+		kind = 2;
+	if (kind == 0 || kind != last_kind)
+		editorUndoBreak();
+	last_kind = kind;
 
 	switch (c) {
 		case '\r':
@@ -1306,6 +5039,7 @@ void editorProcessKeypress(int c) {
 			break;
 
 		case CTRL_KEY('q'):
+			editorWaitForSave();
 			if (E.dirty && quit_times > 0) {
 				editorSetStatusMessage("WARNING!!! File has unsaved changes. Press CTRL-Q %d more time%s to quit.", quit_times, quit_times > 1 ? "s" : "");
 				quit_times--;
@@ -1326,17 +5060,35 @@ void editorProcessKeypress(int c) {
 
 		case END_KEY:
 			if (E.cy < E.numrows)
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			break;
 
 		case CTRL_KEY('f'):
-			editorFind();
+			editorFind(false);
+			break;
+
+		case CTRL_KEY('r'):
+			editorFind(true);
+			break;
+
+		case CTRL_KEY('t'):
+			editorReplace();
 			break;
 
 		case CTRL_KEY('g'):
 			editorJump();
 			break;
 
+		case CTRL_KEY('z'):
+			if (!editorUndo())
+				editorSetStatusMessage("Nothing to undo");
+			break;
+
+		case CTRL_KEY('y'):
+			if (!editorRedo())
+				editorSetStatusMessage("Nothing to redo");
+			break;
+
 		case BACKSPACE:
 		case CTRL_KEY('h'):
 		case DEL_KEY:
@@ -1371,28 +5123,28 @@ void editorProcessKeypress(int c) {
 
 		case CTRL_ARROW_LEFT:
 			{
-				erow *row = &E.row[E.cy];
+				erow *row = editorRowAt(E.cy);
 				if (E.cx == 0) {
 					editorMoveCursor(ARROW_LEFT);
 				} else {
-					if (row->chars[E.cx] == ' ')
-						while (row->chars[E.cx] == ' ')
+					if (E.cx < row->size && row->chars[E.cx] == ' ')
+						while (E.cx < row->size && row->chars[E.cx] == ' ')
 							editorMoveCursor(ARROW_LEFT);
-					while (row->chars[E.cx] != ' ' && E.cx > 0)
+					while ((E.cx >= row->size || row->chars[E.cx] != ' ') && E.cx > 0)
 						editorMoveCursor(ARROW_LEFT);
 				}
 			}
 			break;
 		case CTRL_ARROW_RIGHT:
 			{
-				erow *row = &E.row[E.cy];
+				erow *row = editorRowAt(E.cy);
 				if (E.cx == row->size) {
 					editorMoveCursor(ARROW_RIGHT);
 				} else {
 					if (row->chars[E.cx] == ' ')
-						while (row->chars[E.cx] == ' ')
+						while (E.cx < row->size && row->chars[E.cx] == ' ')
 							editorMoveCursor(ARROW_RIGHT);
-					while (row->chars[E.cx] != ' ' && E.cx < row->size)
+					while (E.cx < row->size && row->chars[E.cx] != ' ')
 						editorMoveCursor(ARROW_RIGHT);
 				}
 			}
@@ -1405,6 +5157,10 @@ void editorProcessKeypress(int c) {
 			editorMoveCursor(c);
 			break;
 
+		case PASTE:
+			editorInsertText(input.paste, input.paste_len);
+			break;
+
 		case CTRL_KEY('l'):
 		case '\x1b':
 			break;
@@ -1425,17 +5181,42 @@ void initEditor() {
 	E.rowoff = 0;
 	E.coloff = 0;
 	E.numrows = 0;
-	E.row = NULL;
+	E.rope = ropeNewNode(true);
+	E.map = NULL;
+	E.mapsize = 0;
 	E.dirty = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
+	E.hl_checked = 0;
+	E.version = 0;
+	pthread_mutex_init(&E.lock, NULL);
+	atomic_init(&E.lock_wanted, false);
+	pthread_cond_init(&E.hl_cond, NULL);
+	E.save = NULL;
+	pthread_cond_init(&E.save_done, NULL);
+	E.prompting = false;
+	const char *esc_timeout = getenv("KILO_ESC_TIMEOUT");
+	E.esc_timeout = esc_timeout ? atoi(esc_timeout) : KILO_ESC_TIMEOUT;
+	if (E.esc_timeout < 0)
+		E.esc_timeout = KILO_ESC_TIMEOUT;
+	const char *undo_mb = getenv("KILO_UNDO_MB");
+	undo.limit = undo_mb && atoi(undo_mb) > 0 ? (size_t)atoi(undo_mb) << 20 : KILO_UNDO_LIMIT;
+	const char *fps = getenv("KILO_MAX_FPS");
+	E.frame_interval = fps && atoi(fps) > 0 ? 1000 / atoi(fps) : 0;
+	E.frame_time = (struct timespec){0, 0};
+	editorLock();
+
+	editorInitKernels();
+	editorLoadSyntaxes();
 
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
 		die("getWindowSize");
 	E.screenrows -= 2;
 
+	if (pipe2(input.resize_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		die("pipe2");
 	signal(SIGWINCH, handleWindowResize);
 }
 int main(int argc, char *argv[]) {
@@ -1444,11 +5225,12 @@ int main(int argc, char *argv[]) {
 	initEditor();
 	if (argc >= 2)
 		editorOpen(argv[1]);
+	editorStartHighlighter();
 
-	editorSetStatusMessage("HELP: CTRL-S = save | CTRL-Q = quit | CTRL-F = find | CTRL-G = jump");
+	editorSetStatusMessage("HELP: ^S save | ^Q quit | ^F find | ^R regex | ^T replace | ^G jump | ^Z undo");
 
 	while (1) {
-		editorRefreshScreen();
+		editorFrame();
 		editorProcessKeypress(editorReadKey());
 	}
 